@@ -9,9 +9,10 @@
 #define PASSWORD_SIZE 50
 #define ADDRESS_SIZE 30
 #define USERNAME_SIZE 50
-#define MQTT_CLIENTID_SIZE 25
+#define MQTT_CLIENTID_SIZE 25 //MQTT_CLIENT_ID_ROOT and 12 hex digits of MAC address
 #define MQTT_TOPIC_SIZE 150
 #define WIFI_ATTEMPTS 25
+#define WIFI_ATTEMPT_MS 500 //a full connection gets WIFI_ATTEMPTS of these
 #define MQTT_TOPIC_BATTERY "battery"
 #define MQTT_TOPIC_ANALOG "analog"
 #define MQTT_TOPIC_RSSI "rssi"
@@ -22,14 +23,90 @@
 #define MQTT_PAYLOAD_REBOOT_COMMAND "reboot" //reboot the controller
 #define MQTT_PAYLOAD_VERSION_COMMAND "version" //show the version number
 #define MQTT_PAYLOAD_STATUS_COMMAND "status" //show the most recent flow values
+#define MQTT_PAYLOAD_SLEEP_COMMAND "sleep" //sent to ourself after a report, go to sleep when it comes back
+#define MQTT_TOPIC_CONFIRM "confirm"
+#define MQTT_TOPIC_TELEMETRY "telemetry"
+#define TELEMETRY_JSON_SIZE 220
+#define COMMAND_SIZE 200 //longest command line that can be typed on the serial port
+#define MQTT_COMMAND_SIZE MQTT_MAX_PACKET_SIZE //longest command payload, the most the MQTT buffer can bring in
+#define MQTT_OVERHEAD 7 //PubSubClient's fixed header and topic length, which share its buffer with a message
+#define JSON_CHUNK_SIZE 64 //bytes of JSON gathered before they are written to the MQTT client
+#define MQTT_TOPIC_ERROR "error"
 #define MQTT_RECONNECT_TRIES 3 // Give up if can't connect to broker in this many tries
-#define JSON_STATUS_SIZE SSID_SIZE+PASSWORD_SIZE+USERNAME_SIZE+MQTT_TOPIC_SIZE+50 //+50 for associated field names, etc
-#define PUBLISH_DELAY 400 //milliseconds to wait after publishing to MQTT to allow transaction to finish
-//#define MAX_CHANGE_PCT 2 //percent distance change must be greater than this before reporting
+#define MQTT_RETRY_DELAY 1000 //milliseconds between tries, spent servicing everything else
+#define MQTT_CONNECT_TIMEOUT 2000 //milliseconds a connection attempt may take before it fails
+#define DNS_TIMEOUT 2000 //milliseconds to wait for the broker's address to be looked up
+#define BROKER_LOOKUP_INTERVAL 1440 //minutes a looked up broker address is kept in RTC memory
+#define WAKE_BUDGET 10000 //milliseconds a report may take. After that the reading is kept for next time.
+#define REPORT_POLL 1 //milliseconds between steps of a report that is waiting on the network
+#define BACKOFF_START 2 //failed reports in a row before the radio is rested for some wakes
+#define BACKOFF_LIMIT 7200 //seconds. The rest doubles with each failure up to about this long.
+#define WIFI_MIN_SCAN_MS 3000 //the full scan budget halves with each failure in a row down to this
+#define RADIO_DAILY_BUDGET 0 //default seconds a day the radio may be on, 0 for no limit
+#define MQTT_TOPIC_OUTAGE "outage"
+#define TRANSACTION_KEYS_SIZE 120 //room for the names of the keys applied or rejected in a transaction
+#define TRANSACTION_SUMMARY_SIZE TRANSACTION_KEYS_SIZE*2+30
+#define TRANSACTION_TIMEOUT 300000 //milliseconds a transaction may go without a command before it is aborted and we can sleep
+#define IDLE_SLICE_MS 250 //longest nap between checks for work when staying awake
+#define LIGHT_SLEEP_LISTEN_INTERVAL 3 //beacon intervals the radio may sleep through when idle
+#define CONFIRM_TIMEOUT 2000 //milliseconds to wait for our own sleep command to come back before sleeping anyway
+#define DEFAULT_HEARTBEAT 1440 //minutes. With a deadband set, report at least this often even if nothing changed
+#define RADIO_WAKE_SLEEP 1 //seconds to sleep when a radio-off wake finds something to report
+#define ADAPTIVE_STEP 10 //raw counts the reading should move between adaptive readings if there is no deadband
+#define STAGGER_MIN_PERIOD 10000 //milliseconds. Shorter sleeps aren't moved to the unit's wake slot.
+#define STAGGER_JITTER_DIVISOR 50 //wake jitter is at most this fraction of the period
+#define STAGGER_JITTER_MAX 3000 //and at most this many milliseconds
+#ifndef QUIET_BOOT
+#define QUIET_BOOT 1 //timer wakes keep the console quiet until something is typed. Build with -DQUIET_BOOT=0 to always start it.
+#endif
+#define DEFAULT_TIME_SERVER "pool.ntp.org"
+#define CLOCK_SYNC_INTERVAL 43200000ULL //milliseconds between time server syncs
+#define CLOCK_SYNC_TIMEOUT 1000 //milliseconds to wait for the time server
+#define CLOCK_VALID_TIME 1600000000UL //a time server answer is later than this, in Unix seconds
+#define MAX_SLEEP_STRETCH 8 //the adaptive scheduler can sleep up to this many times sleepTime
 #define FULL_BATTERY 3178 //raw A0 count with two alkaline batteries 
 #define FULL_VOLTAGE 318  //Actual voltage when two fresh alkaline batteries are connected
+#define CAL_POINTS 6 //most points in the voltage calibration table
+#define CAL_MERGE 8 //raw counts within which a new calibration point replaces an old one
+#define CAL_MAX 32767 //largest raw reading or millivolts a calibration point may have
+#define CAL_TEXT_SIZE CAL_POINTS*12+1 //"raw:millivolts," for each point
 #define ONE_HOUR 3600000 //milliseconds
+#define EMPTY_BATTERY 2500 //raw A0 count below which the ESP8266 stops working reliably
+#define HISTORY_SIZE 16 //number of points in the discharge history
+#define HISTORY_INTERVAL 480 //minutes of readings averaged into each point of the history
+#define MQTT_TOPIC_LIFE "life"
 #define SAMPLE_COUNT 5 //number of samples to take per measurement 
+#define MAX_SAMPLE_COUNT 32 //most samples that can be taken per measurement
+#define SAMPLE_SPACING 250 //microseconds between samples in a burst, so the noise isn't correlated
+#define SAMPLE_TRIM 4 //drop 1/4 of the samples from each end before averaging
+#define MQTT_TOPIC_VARIANCE "variance"
+#define VALID_RTC_FLAG 0xB7E5 //marks the RTC memory as having been written by us
+#define RTC_DATA_OFFSET 32 //RTC user memory block (4 bytes each) to use. The first 128 bytes get clobbered by OTA.
+#define RTC_DATA_MAX_SIZE 384 //bytes of RTC user memory available from RTC_DATA_OFFSET to the end
+#define TRACE_OFFSET 0 //RTC user memory block where the trace ring starts, below RTC_DATA_OFFSET. Lost to an OTA update, which is fine.
+#define TRACE_SIZE 15 //entries in the trace ring, filling the blocks up to RTC_DATA_OFFSET
+#define VALID_TRACE_FLAG 0x7ACE //marks the trace ring as having been written by us
+#define MQTT_PAYLOAD_TRACE_COMMAND "trace" //publish the trace ring
+#define MQTT_TOPIC_TRACE "trace"
+#define WIFI_FAST_TIMEOUT 3000 //milliseconds to wait for a connection using the cached BSSID and channel
+#define WIFI_EVENT_POLL 1 //milliseconds between looks at the WiFi event flags. The SDK runs the callbacks during delay().
+#define MQTT_TOPIC_WIFI_CACHE "wifiCache"
+#define MQTT_TOPIC_BATCH "batch"
+#define MAX_BATCH_SIZE 24 //most readings that can be held in RTC memory between uplinks
+#define BATCH_JSON_SIZE MAX_BATCH_SIZE*12+50 //a reading and its age, 5 digits and a comma each, plus the wrapper
+#define LOG_DIR "/log" //where the flash log segments live
+#define LOG_SEGMENT_RECORDS 340 //records per segment file, so a full segment is one 4k flash block
+#define LOG_MAX_SEGMENTS 96 //segments kept before the oldest is dropped, about 32000 readings
+#define LOG_CHUNK_RECORDS 20 //readings per backlog message, small enough for the MQTT buffer
+#define LOG_CHUNK_JSON_SIZE LOG_CHUNK_RECORDS*12+70
+#define LOG_CHUNKS_PER_WAKE 50 //most backlog messages sent in one wake
+#define MQTT_TOPIC_BACKLOG "backlog"
+#define MQTT_TOPIC_REPORT "report"
+#define REPORT_FORMAT_LEGACY 0 //a text message on its own topic for each value
+#define REPORT_FORMAT_CSV 1 //one message: sequence,raw,millivolts,rssi,reset reason,hours left,discharge rate,variance
+#define REPORT_FORMAT_BINARY 2 //one message: a reportPacket
+#define REPORT_PACKET_VERSION 3 //first byte of the binary report, bump when the layout changes
+#define DEFAULT_DIAGNOSTICS 10 //the packed formats send the diagnostic messages with every this many reports
 
 // Error codes copied from the MQTT library
 // #define MQTT_CONNECTION_REFUSED            -2
@@ -48,29 +125,247 @@
 //4 : WL_CONNECT_FAILED if password is incorrect
 //6 : WL_DISCONNECTED if module is not configured in station mode
 
+// The kinds of setting in the settings table
+enum settingType
+  {
+  SETTING_TEXT,   // a char array
+  SETTING_INT,    // an int with a range
+  SETTING_BOOL,   // a bool, set with 1 or 0
+  SETTING_CHOICE  // an int, set by name from a list
+  };
+#define SETTING_RESTART 0x01 //changing it takes a restart
+#define SETTING_REQUIRED 0x02 //settings aren't complete until it has a value
+#define SETTING_CLAMP 0x04 //a value out of range is brought into range rather than rejected
+#define SETTING_READONLY 0x08 //shown, but not set by a command
+#define SETTING_BUCKETS 64 //slots in the settings lookup, at least twice the number of settings
+#define SETTING_VALUE_SIZE MQTT_TOPIC_SIZE //the longest setting, as text
+
+// One entry in the settings table
+typedef struct
+  {
+  const char* name; //the command and the JSON key
+  uint32_t hash; //settingHash(name), for the lookup
+  uint16_t offset; //where the value is in conf
+  settingType type;
+  uint16_t size; //text: size of the char array including the terminator
+  int32_t minimum; //numbers: the allowed range
+  int32_t maximum;
+  int32_t initial; //numbers: the default
+  const char* initialText; //text: the default
+  uint8_t flags; //SETTING_ values
+  const char* help; //what to type, for showSettings()
+  const char* const* choices; //SETTING_CHOICE: the names, indexed by value
+  } settingDescriptor;
+
+// State for writing JSON straight to the MQTT client. With no client it only counts,
+// which is how the length is found before beginPublish() needs it.
+typedef struct
+  {
+  PubSubClient* client; //NULL to just count
+  size_t length; //bytes so far
+  boolean first; //no comma needed before the next member
+  uint8_t chunk[JSON_CHUNK_SIZE]; //gathered here so the client isn't written a byte at a time
+  size_t chunkLength;
+  } jsonWriter;
+
+// The parts of a wake that are timed for the telemetry message, in the order they happen
+enum wakePhase
+  {
+  PHASE_BOOT,       // reset to the start of setup()
+  PHASE_SERIAL,     // console initialization
+  PHASE_SETTINGS,   // loading EEPROM and RTC memory
+  PHASE_MEASURE,    // taking the battery reading
+  PHASE_WIFI,       // associating with the access point, with OTA setup and the like done meanwhile
+  PHASE_MQTT,       // connecting to the broker and subscribing
+  PHASE_PUBLISH,    // sending the report
+  PHASE_SLEEP_WAIT, // waiting for delivery to be confirmed
+  PHASE_COUNT
+  };
+
+// Where a report is. runReport() takes it a step at a time from loop(), so nothing
+// waits longer than a step's timeout.
+enum reportStep
+  {
+  STEP_IDLE,    // no report under way, or it's done
+  STEP_WIFI,    // waiting for the association
+  STEP_MQTT,    // connecting to the broker, with a pause between tries
+  STEP_PUBLISH, // sending the report and the sleep command
+  STEP_CONFIRM, // waiting for the sleep command to come back
+  };
+
+// What goes into the trace ring. The binary dump has these numbers, so add new ones at the end.
+enum traceEventId
+  {
+  EVENT_RESET,          // woke from something other than deep sleep, value is the reset reason
+  EVENT_SETTINGS,       // value is 1 if they were loaded, 0 if there are none
+  EVENT_RTC_LOST,       // RTC memory was not valid
+  EVENT_SAMPLE,         // value is one ADC sample
+  EVENT_READING,        // value is the filtered reading
+  EVENT_WIFI_BEGIN,     // value is the cached channel, 0 if there is none
+  EVENT_WIFI_UP,        // value is millis()
+  EVENT_WIFI_CACHE_MISS,// value is the cached channel that didn't work
+  EVENT_WIFI_FAILED,    // value is the WiFi status, -1 if the static address couldn't be set
+  EVENT_BAD_ADDRESS,    // value is 0 for the address setting, 1 for the netmask
+  EVENT_MQTT_UP,        // value is millis()
+  EVENT_MQTT_FAILED,    // value is the client state
+  EVENT_SUBSCRIBE,      // value is 1 if it worked
+  EVENT_REPORT,         // value is the report sequence number
+  EVENT_PUBLISH,        // value is the payload length
+  EVENT_PUBLISH_FAILED, // value is the client state
+  EVENT_COMMAND,        // value is the command length
+  EVENT_CONFIRMED,      // value is the delivery confirmation latency, milliseconds
+  EVENT_CONFIRM_TIMEOUT,// value is the number of timeouts so far
+  EVENT_CLOCK_SYNCED,   // value is the drift in ppm
+  EVENT_CLOCK_FAILED,
+  EVENT_FLASH_LOG,      // value is the number of readings involved
+  EVENT_RESTART,
+  EVENT_SLEEP,          // value is milliseconds to sleep
+  EVENT_DNS,            // value is the broker address found, 0 if the lookup failed
+  EVENT_OUT_OF_TIME,    // value is the reportStep that was given up on
+  EVENT_BACKOFF,        // value is the number of wakes the radio will rest
+  EVENT_RADIO_BUDGET,   // value is the radio-on milliseconds used today
+  EVENT_RECOVERED,      // value is the number of failed reports before this one
+  EVENT_COUNT
+  };
+
+// Trace levels. Anything above TRACE_LEVEL is compiled out, message text and all.
+#define TRACE_LEVEL_NONE 0
+#define TRACE_LEVEL_ERROR 1
+#define TRACE_LEVEL_WARN 2
+#define TRACE_LEVEL_INFO 3
+#define TRACE_LEVEL_DEBUG 4
+#ifndef TRACE_LEVEL
+#define TRACE_LEVEL TRACE_LEVEL_INFO
+#endif
+
+// Record an event in the trace ring, and print the message if the console is on. Debug
+// messages are only printed with the debug setting on. The message arguments are only
+// evaluated if it is printed.
+#define TRACE(level,event,value,...) do \
+  { \
+  traceEvent(event,value); \
+  if (consoleOn && (level<TRACE_LEVEL_DEBUG || settings.debug)) \
+    Serial.printf(__VA_ARGS__); \
+  } while (0)
+
+#if TRACE_LEVEL>=TRACE_LEVEL_ERROR
+#define TRACE_ERROR(event,value,...) TRACE(TRACE_LEVEL_ERROR,event,value,__VA_ARGS__)
+#else
+#define TRACE_ERROR(event,value,...) do {} while (0)
+#endif
+#if TRACE_LEVEL>=TRACE_LEVEL_WARN
+#define TRACE_WARN(event,value,...) TRACE(TRACE_LEVEL_WARN,event,value,__VA_ARGS__)
+#else
+#define TRACE_WARN(event,value,...) do {} while (0)
+#endif
+#if TRACE_LEVEL>=TRACE_LEVEL_INFO
+#define TRACE_INFO(event,value,...) TRACE(TRACE_LEVEL_INFO,event,value,__VA_ARGS__)
+#else
+#define TRACE_INFO(event,value,...) do {} while (0)
+#endif
+#if TRACE_LEVEL>=TRACE_LEVEL_DEBUG
+#define TRACE_DEBUG(event,value,...) TRACE(TRACE_LEVEL_DEBUG,event,value,__VA_ARGS__)
+#else
+#define TRACE_DEBUG(event,value,...) do {} while (0)
+#endif
+
 //prototypes
 
 //PubSubClient callback function header.  This must appear before the PubSubClient constructor.
 void incomingMqttHandler(char* reqTopic, byte* payload, unsigned int length);
 unsigned long myMillis();
-bool processCommand(String cmd);
+bool processCommand(char* cmd);
+char* splitCommand(char* cmd);
+void sanitizeSettings();
+const settingDescriptor* findSetting(const char* name);
+boolean applySetting(const settingDescriptor* setting, const char* val);
+void settingToString(const settingDescriptor* setting, char* buf, size_t size);
+void beginTransaction();
+void abortTransaction();
+boolean commitTransaction(char* summary);
+boolean rejectCommand(const char* nme);
+void noteKey(char* list, const char* key);
 void checkForCommand();
-boolean connectToWiFi();
+void startWiFi();
+int checkWiFi();
 void incomingMqttHandler(char* reqTopic, byte* payload, unsigned int length); 
 int measure();
 void showSettings();
-boolean reconnect(); 
-void showSub(char* topic, bool subgood);
+boolean connectMqtt();
+boolean setBrokerAddress();
+uint32_t sessionKey();
+void serviceMqtt();
+void restartProcessor();
 void initializeSettings();
 int readBattery();
-void report();
+boolean report();
+boolean reportLegacy(int analog);
+boolean reportPacked(int analog);
+void reportDiagnostics(int analog);
 boolean publish(char* topic, const char* reading, bool retain);
+boolean publish(char* topic, const uint8_t* payload, unsigned int length, boolean retain);
+boolean publishPayload(const char* topic, const uint8_t* payload, unsigned int length, boolean retain);
+boolean publishJson(char* topic, void (*writer)(jsonWriter*), boolean retain);
+void jsonRaw(jsonWriter* json, const char* text, size_t length);
+void jsonFlush(jsonWriter* json);
+void jsonEscaped(jsonWriter* json, const char* text);
+void jsonKey(jsonWriter* json, const char* name);
+void jsonBeginObject(jsonWriter* json);
+void jsonEndObject(jsonWriter* json);
+void jsonString(jsonWriter* json, const char* name, const char* value);
+void jsonNumber(jsonWriter* json, const char* name, long value);
+void writeSettingsJson(jsonWriter* json);
 void loadSettings();
 boolean saveSettings();
 void saveRTC();
+boolean loadRTC();
+void addToBatch(int raw);
+boolean publishBatch();
+boolean mountLog();
+void segmentName(char* name, uint32_t segment);
+boolean spillBatch();
+void trimLog();
+void drainLog();
+void commitLog();
+void commitBatch();
+void recoverLog();
+void keepReading(int raw);
+RFMode nextWakeMode();
+uint32_t nextSleepTime();
+uint32_t staggeredSleep(uint32_t seconds);
+uint64_t clockNow();
+void measureSleep();
+void syncClock();
+boolean reportNeeded(int raw);
+void goToSleep();
+void idle(unsigned long ms);
+void markPhase(wakePhase phase);
+boolean publishTelemetry(int analog);
+void updateHistory(int raw);
+boolean estimateLife(int32_t* ratePerDay, int32_t* hoursLeft);
+uint32_t calculateCRC32(const uint8_t *data, size_t length);
+void cacheWiFi();
 void serialEvent(); 
-boolean send();
+void startConsole();
+void traceBegin();
+void traceEvent(uint8_t event, int32_t value);
+void showTrace();
+boolean publishTrace();
+void beginReport(int analog);
+void runReport();
+void endReport();
+void complainAboutAddress();
+void setStep(reportStep next);
+boolean publishReport();
+void abandonReport();
+void backOff();
+boolean radioResting();
+boolean radioBudgetSpent();
+boolean publishOutage();
 char* generateMqttClientId(char* mqttId);
-float convertToVoltage(int raw);
+uint16_t toMillivolts(int raw);
+char* formatVolts(uint16_t millivolts, char* buf);
+boolean calibrate(const char* val);
+void calibrationToString(char* buf);
 void setup(); 
 void loop();
\ No newline at end of file
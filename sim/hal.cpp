@@ -0,0 +1,989 @@
+/**
+ * Implementation of the host hardware abstraction layer. Every call that would take
+ * time on the real part moves the virtual clock, and every microsecond is charged
+ * to the current phase of the energy model.
+ */
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "Arduino.h"
+#include "ESP8266WiFi.h"
+#include "PubSubClient.h"
+#include "EEPROM.h"
+#include "ArduinoOTA.h"
+#include "LittleFS.h"
+#include "sntp.h"
+
+SimShared *sim=NULL;
+SimBroker *simBroker=NULL;
+
+HardwareSerial Serial;
+EspClass ESP;
+ESP8266WiFiClass WiFi;
+EEPROMClass EEPROM;
+ArduinoOTAClass ArduinoOTA;
+FS LittleFS;
+
+#define SIM_CALL_US 2       // cost of a cheap library call, so polling loops make progress
+#define SIM_TYPING_US 500000 // time between console lines
+#define SIM_PACKET_US 300   // per-packet airtime overhead: preamble, MAC ack, TCP ack
+
+/*
+ * Move the virtual clock, charging the elapsed time to the current phase. A phase
+ * change scheduled by the radio in the middle of the interval is honored.
+ */
+void simAdvanceUs(uint64_t us)
+  {
+  while (us>0)
+    {
+    uint64_t step=us;
+    if (sim->transitionUs>sim->nowUs && sim->transitionUs-sim->nowUs<step)
+      step=sim->transitionUs-sim->nowUs;
+    double mAs=sim->model.current_mA[sim->phase]*step/1e6;
+    sim->rtcCycles+=step/(sim->phase==SIM_PHASE_SLEEP ? SIM_RTC_PERIOD_US*(1+sim->model.rtcDriftPct/100) : SIM_RTC_PERIOD_US);
+    sim->stats.phaseUs[sim->phase]+=step;
+    sim->stats.phase_mAs[sim->phase]+=mAs;
+    sim->batteryUsed_mAs+=mAs;
+    if (sim->phase!=SIM_PHASE_SLEEP)
+      sim->stats.awakeUs+=step;
+    sim->nowUs+=step;
+    us-=step;
+    if (sim->transitionUs!=0 && sim->nowUs>=sim->transitionUs)
+      {
+      sim->phase=sim->transitionPhase;
+      sim->transitionUs=0;
+      }
+    }
+  if (sim->phase!=SIM_PHASE_SLEEP && sim->nowUs-sim->wakeStartUs>(uint64_t)sim->model.maxAwakeMs*1000)
+    simEndWake(SIM_EXIT_TIMEOUT);
+  }
+
+void simSetPhase(int phase)
+  {
+  sim->phase=phase;
+  sim->transitionUs=0;
+  }
+
+/*
+ * Put some bytes on the air. The radio goes back to whatever it was doing afterward.
+ */
+void simTransmit(uint32_t bytes)
+  {
+  int was=sim->phase;
+  uint64_t pendingTransition=sim->transitionUs;
+  sim->phase=SIM_PHASE_TX;
+  sim->transitionUs=0;
+  simAdvanceUs(SIM_PACKET_US+(uint64_t)bytes*1000/max(sim->model.txBytesPerMs,1u));
+  sim->phase=was;
+  sim->transitionUs=pendingTransition;
+  }
+
+void simEndWake(int exitKind)
+  {
+  sim->exitKind=exitKind;
+  fflush(stdout);
+  _exit(0);
+  }
+
+uint32_t simRandom()
+  {
+  // xorshift32, so runs are repeatable for a given seed
+  uint32_t x=sim->rng;
+  x^=x<<13;
+  x^=x>>17;
+  x^=x<<5;
+  sim->rng=x ? x : 0x1234567;
+  return sim->rng;
+  }
+
+double simRandomUnit()
+  {
+  return (simRandom() & 0xffffff)/(double)0x1000000;
+  }
+
+/*
+ * Open-circuit voltage of two alkaline cells in series, by fraction of capacity used.
+ */
+double simBatteryVolts()
+  {
+  static const double used[]= {0.0, 0.10, 0.50, 0.80, 0.95, 1.00};
+  static const double volts[]={3.20, 2.95, 2.60, 2.35, 2.10, 1.80};
+  double f=sim->batteryUsed_mAs/3600.0/sim->model.capacity_mAh;
+  if (f<=0)
+    return volts[0];
+  for (size_t i=1; i<sizeof(used)/sizeof(used[0]); i++)
+    {
+    if (f<=used[i])
+      return volts[i-1]+(volts[i]-volts[i-1])*(f-used[i-1])/(used[i]-used[i-1]);
+    }
+  return 1.6;
+  }
+
+uint64_t simWakeUs()
+  {
+  return sim->nowUs-sim->wakeStartUs;
+  }
+
+/********************** Arduino core **********************/
+
+unsigned long millis()
+  {
+  simAdvanceUs(SIM_CALL_US);
+  return (unsigned long)(simWakeUs()/1000);
+  }
+
+unsigned long micros()
+  {
+  simAdvanceUs(SIM_CALL_US);
+  return (unsigned long)simWakeUs();
+  }
+
+/*
+ * With light sleep allowed, the SDK sleeps through a delay() once nothing is going
+ * on, only waking for beacons.
+ */
+void delay(unsigned long ms)
+  {
+  int was=sim->phase;
+  bool nap=WiFi.getSleepMode()==WIFI_LIGHT_SLEEP && sim->transitionUs==0
+    && (was==SIM_PHASE_CPU || was==SIM_PHASE_CONNECTED);
+  if (nap)
+    sim->phase=SIM_PHASE_LIGHT;
+  simAdvanceUs((uint64_t)ms*1000);
+  if (nap)
+    sim->phase=was;
+  WiFi.runEvents();
+  }
+
+void delayMicroseconds(unsigned int us)
+  {
+  simAdvanceUs(us);
+  }
+
+void yield()
+  {
+  simAdvanceUs(SIM_CALL_US);
+  WiFi.runEvents();
+  }
+
+long random(long howBig)
+  {
+  return howBig<=0 ? 0 : (long)(simRandom()%howBig);
+  }
+
+long random(long howSmall, long howBig)
+  {
+  return howSmall>=howBig ? howSmall : howSmall+random(howBig-howSmall);
+  }
+
+void randomSeed(unsigned long seed)
+  {
+  if (seed!=0)
+    sim->rng=seed;
+  }
+
+String IPAddress::toString() const
+  {
+  char buf[16];
+  snprintf(buf,sizeof(buf),"%u.%u.%u.%u",(*this)[0],(*this)[1],(*this)[2],(*this)[3]);
+  return String(buf);
+  }
+
+/*
+ * Output is charged at the line rate, ten bits per character.
+ */
+size_t HardwareSerial::write(const char* s, size_t len)
+  {
+  if (!started || serialMode==SERIAL_RX_ONLY)
+    return 0;
+  sim->stats.serialBytes+=len;
+  if (sim->model.verbose)
+    fwrite(s,1,len,stdout);
+  simAdvanceUs((uint64_t)len*10*1000000/baud);
+  return len;
+  }
+
+size_t HardwareSerial::printf(const char* format, ...)
+  {
+  char buf[256];
+  va_list args;
+  va_start(args,format);
+  int n=vsnprintf(buf,sizeof(buf),format,args);
+  va_end(args);
+  return n>0 ? write(buf,min((size_t)n,sizeof(buf)-1)) : 0;
+  }
+
+/*
+ * Console input is typed a line at a time: one when the wake starts, and the next
+ * a moment after the firmware has read the last one. A device that restarts after
+ * every setting sees one line per wake.
+ */
+void simTypeLine()
+  {
+  while (sim->serialInLineEnd<sim->serialInLen && sim->serialIn[sim->serialInLineEnd++]!='\n');
+  }
+
+int HardwareSerial::available()
+  {
+  simAdvanceUs(SIM_CALL_US);
+  if (sim->serialInPos>=sim->serialInLineEnd && sim->nowUs-sim->serialLineUs>=SIM_TYPING_US)
+    simTypeLine();
+  return started && serialMode!=SERIAL_TX_ONLY ? sim->serialInLineEnd-sim->serialInPos : 0;
+  }
+
+int HardwareSerial::read()
+  {
+  if (!started || serialMode==SERIAL_TX_ONLY || sim->serialInPos>=sim->serialInLineEnd)
+    return -1;
+  if (sim->serialInPos+1==sim->serialInLineEnd)
+    sim->serialLineUs=sim->nowUs;
+  return (uint8_t)sim->serialIn[sim->serialInPos++];
+  }
+
+uint16_t EspClass::getVcc()
+  {
+  simAdvanceUs(70);
+  double sag=sim->model.current_mA[sim->phase]/1000.0*sim->model.internalOhms;
+  double noise=(simRandomUnit()*2-1)*sim->model.noiseCounts;
+  return (uint16_t)lround((simBatteryVolts()-sag)*1000+noise);
+  }
+
+uint32_t EspClass::getChipId()
+  {
+  return sim->chipId;
+  }
+
+void EspClass::restart()
+  {
+  simEndWake(SIM_EXIT_RESTART);
+  for (;;);
+  }
+
+void EspClass::deepSleep(uint64_t timeUs, RFMode mode)
+  {
+  sim->sleepUs=timeUs;
+  sim->nextRfMode=mode;
+  simEndWake(SIM_EXIT_SLEEP);
+  for (;;);
+  }
+
+bool EspClass::rtcUserMemoryRead(uint32_t offset, uint32_t* data, size_t size)
+  {
+  if (offset*4+size>SIM_RTC_BYTES)
+    return false;
+  memcpy(data,sim->rtcMem+offset*4,size);
+  return true;
+  }
+
+bool EspClass::rtcUserMemoryWrite(uint32_t offset, uint32_t* data, size_t size)
+  {
+  if (offset*4+size>SIM_RTC_BYTES)
+    return false;
+  memcpy(sim->rtcMem+offset*4,data,size);
+  return true;
+  }
+
+uint32_t system_get_rtc_time()
+  {
+  simAdvanceUs(SIM_CALL_US);
+  return (uint32_t)(uint64_t)sim->rtcCycles;
+  }
+
+uint32_t system_rtc_clock_cali_proc()
+  {
+  simAdvanceUs(SIM_CALL_US);
+  return (uint32_t)lround(SIM_RTC_PERIOD_US*4096);
+  }
+
+rst_info* EspClass::getResetInfoPtr()
+  {
+  static rst_info info;
+  info.reason=sim->resetReason;
+  return &info;
+  }
+
+/********************** EEPROM **********************/
+
+void EEPROMClass::begin(size_t size)
+  {
+  this->size=min(size,(size_t)SIM_EEPROM_BYTES);
+  memcpy(buffer,sim->eeprom,this->size);
+  simAdvanceUs(1000); // reading the sector
+  }
+
+/*
+ * A commit erases and rewrites the whole flash sector, about 50ms on the real part.
+ */
+bool EEPROMClass::commit()
+  {
+  memcpy(sim->eeprom,buffer,size);
+  sim->stats.eepromCommits++;
+  simAdvanceUs(50000);
+  return true;
+  }
+
+/********************** LittleFS **********************/
+
+#define SIM_FS_BLOCK 4096
+#define SIM_FS_MOUNT_US 20000    // reading the superblocks and walking the metadata
+#define SIM_FS_BLOCK_US 45000    // erasing and programming one block
+#define SIM_FS_READ_US 200       // reading a few records
+
+bool FS::begin()
+  {
+  if (!mounted)
+    {
+    mounted=true;
+    sim->stats.fsMounts++;
+    simAdvanceUs(SIM_FS_MOUNT_US);
+    }
+  return true;
+  }
+
+std::string FS::hostPath(const char* path)
+  {
+  std::string p=path;
+  for (char& c : p)
+    if (c=='/')
+      c='_'; // flatten the tree, the firmware only uses one directory
+  return std::string(sim->fsDir)+"/"+p;
+  }
+
+/*
+ * Parent directories are created as needed, the same as the ESP8266 LittleFS does.
+ */
+File FS::open(const char* path, const char* mode)
+  {
+  if (!mounted)
+    return File();
+  FILE* fp=fopen(hostPath(path).c_str(),strcmp(mode,"r")==0?"rb":strcmp(mode,"a")==0?"ab":"wb");
+  if (fp && strcmp(mode,"a")==0)
+    fseek(fp,0,SEEK_END);
+  simAdvanceUs(SIM_FS_READ_US);
+  return fp ? File(fp) : File();
+  }
+
+bool FS::exists(const char* path)
+  {
+  struct stat st;
+  return mounted && stat(hostPath(path).c_str(),&st)==0;
+  }
+
+bool FS::remove(const char* path)
+  {
+  simAdvanceUs(SIM_FS_READ_US);
+  return mounted && unlink(hostPath(path).c_str())==0;
+  }
+
+bool FS::mkdir(const char*)
+  {
+  return mounted;
+  }
+
+Dir FS::openDir(const char* path)
+  {
+  Dir dir;
+  if (!mounted)
+    return dir;
+  std::string prefix=hostPath(path)+"_";
+  prefix=prefix.substr(strlen(sim->fsDir)+1);
+  DIR* d=opendir(sim->fsDir);
+  if (!d)
+    return dir;
+  while (struct dirent* e=readdir(d))
+    {
+    if (strncmp(e->d_name,prefix.c_str(),prefix.size())!=0)
+      continue;
+    struct stat st;
+    std::string full=std::string(sim->fsDir)+"/"+e->d_name;
+    if (stat(full.c_str(),&st)!=0)
+      continue;
+    dir.names.push_back(e->d_name+prefix.size());
+    dir.sizes.push_back(st.st_size);
+    }
+  closedir(d);
+  simAdvanceUs(SIM_FS_READ_US*(1+dir.names.size()));
+  return dir;
+  }
+
+/*
+ * Every block the write touches is erased and rewritten, including the partly
+ * full one at the end of the file.
+ */
+size_t File::write(const uint8_t* buf, size_t size)
+  {
+  if (!fp)
+    return 0;
+  long start=ftell(fp.get());
+  size_t n=fwrite(buf,1,size,fp.get());
+  uint64_t blocks=(start+n+SIM_FS_BLOCK-1)/SIM_FS_BLOCK-start/SIM_FS_BLOCK;
+  sim->stats.fsBlockWrites+=blocks;
+  sim->stats.fsBytesWritten+=n;
+  simAdvanceUs(blocks*SIM_FS_BLOCK_US);
+  return n;
+  }
+
+size_t File::read(uint8_t* buf, size_t size)
+  {
+  if (!fp)
+    return 0;
+  simAdvanceUs(SIM_CALL_US+size/16);
+  return fread(buf,1,size,fp.get());
+  }
+
+bool File::seek(uint32_t pos, SeekMode mode)
+  {
+  return fp && fseek(fp.get(),pos,mode==SeekSet?SEEK_SET:mode==SeekCur?SEEK_CUR:SEEK_END)==0;
+  }
+
+size_t File::size()
+  {
+  if (!fp)
+    return 0;
+  long here=ftell(fp.get());
+  fseek(fp.get(),0,SEEK_END);
+  long size=ftell(fp.get());
+  fseek(fp.get(),here,SEEK_SET);
+  return size;
+  }
+
+/********************** WiFi **********************/
+
+bool ESP8266WiFiClass::mode(WiFiMode_t m)
+  {
+  wifiMode=m;
+  if (m==WIFI_OFF)
+    {
+    state=WL_DISCONNECTED;
+    simSetPhase(SIM_PHASE_CPU);
+    }
+  return true;
+  }
+
+bool ESP8266WiFiClass::config(IPAddress local, IPAddress gateway, IPAddress subnet, IPAddress dns1, IPAddress dns2)
+  {
+  (void)dns2;
+  staticConfig=local.isSet();
+  this->local=local;
+  this->gateway=gateway;
+  this->subnet=subnet;
+  this->dns=dns1;
+  return true;
+  }
+
+/*
+ * Start associating. With the right channel and BSSID the scan is skipped, and with
+ * a static configuration so is DHCP. A wrong channel or BSSID never connects.
+ */
+wl_status_t ESP8266WiFiClass::begin(const char* ssid, const char* passphrase, int32_t channel, const uint8_t* bssid, bool connect)
+  {
+  (void)ssid;
+  (void)passphrase;
+  (void)connect;
+  if (wifiMode==WIFI_OFF)
+    wifiMode=WIFI_STA;
+  state=WL_IDLE_STATUS;
+  gotIpPending=false;
+  giveUpAtUs=UINT64_MAX;
+  fast=channel!=0 && bssid!=NULL;
+  bool reachable=sim->apUp && sim->rfMode!=RF_DISABLED;
+  if (fast && (channel!=sim->model.channel || memcmp(bssid,sim->model.bssid,6)!=0))
+    reachable=false;
+  simSetPhase(SIM_PHASE_ASSOC);
+  if (reachable)
+    {
+    uint64_t ms=(fast ? sim->model.fastAssocMs : sim->model.scanMs)+(staticConfig ? 0 : sim->model.dhcpMs);
+    ms=ms*(80+simRandom()%41)/100; // +/-20%
+    ms+=(uint64_t)simBrokerSecond(sim->nowUs)->associations++*sim->model.apContentionMs; // others in the air
+    connectAtUs=sim->nowUs+ms*1000;
+    sim->transitionUs=connectAtUs;
+    sim->transitionPhase=SIM_PHASE_CONNECTED;
+    }
+  else
+    {
+    connectAtUs=UINT64_MAX;
+    giveUpEveryUs=(uint64_t)(fast ? sim->model.fastAssocMs : sim->model.scanMs)*1000;
+    giveUpAtUs=sim->nowUs+giveUpEveryUs;
+    sim->stats.wifiFailures++;
+    }
+  simAdvanceUs(SIM_CALL_US);
+  return state;
+  }
+
+/*
+ * Run the callbacks for whatever has happened since last time.
+ */
+void ESP8266WiFiClass::runEvents()
+  {
+  if (state==WL_IDLE_STATUS && sim->nowUs>=connectAtUs)
+    joined();
+  if (gotIpPending)
+    {
+    gotIpPending=false;
+    if (gotIpCallback)
+      gotIpCallback(WiFiEventStationModeGotIP{local,subnet,gateway});
+    }
+  if (state==WL_IDLE_STATUS && sim->nowUs>=giveUpAtUs)
+    {
+    giveUpAtUs+=giveUpEveryUs;
+    WiFiEventStationModeDisconnected event;
+    memcpy(event.bssid,bssid,6);
+    event.reason=WIFI_DISCONNECT_REASON_NO_AP_FOUND;
+    if (disconnectedCallback)
+      disconnectedCallback(event);
+    }
+  }
+
+wl_status_t ESP8266WiFiClass::status()
+  {
+  simAdvanceUs(SIM_CALL_US);
+  if (state==WL_IDLE_STATUS && sim->nowUs>=connectAtUs)
+    joined();
+  return state;
+  }
+
+void ESP8266WiFiClass::joined()
+  {
+  state=WL_CONNECTED;
+  if (fast)
+    sim->stats.wifiFast++;
+  else
+    sim->stats.wifiFull++;
+  if (!staticConfig)
+    {
+    local=IPAddress(10,0,(sim->chipId>>8)&0xff,sim->chipId&0xff);
+    gateway=IPAddress(10,0,0,1);
+    subnet=IPAddress(255,255,0,0);
+    dns=IPAddress(10,0,0,1);
+    }
+  memcpy(bssid,sim->model.bssid,6);
+  gotIpPending=true;
+  simSetPhase(SIM_PHASE_CONNECTED);
+  }
+
+bool ESP8266WiFiClass::disconnect(bool wifioff)
+  {
+  if (state==WL_CONNECTED)
+    simTransmit(30); // deauthentication
+  state=WL_DISCONNECTED;
+  connectAtUs=UINT64_MAX;
+  giveUpAtUs=UINT64_MAX;
+  gotIpPending=false;
+  simSetPhase(wifioff ? SIM_PHASE_CPU : SIM_PHASE_CONNECTED);
+  return true;
+  }
+
+uint8_t* ESP8266WiFiClass::macAddress(uint8_t* mac)
+  {
+  mac[0]=0x5c;
+  mac[1]=0xcf;
+  mac[2]=0x7f;
+  mac[3]=(sim->chipId>>16) & 0xff;
+  mac[4]=(sim->chipId>>8) & 0xff;
+  mac[5]=sim->chipId & 0xff;
+  return mac;
+  }
+
+bool ESP8266WiFiClass::forceSleepBegin(uint32_t sleepUs)
+  {
+  (void)sleepUs;
+  state=WL_DISCONNECTED;
+  connectAtUs=UINT64_MAX;
+  simSetPhase(SIM_PHASE_CPU);
+  return true;
+  }
+
+bool ESP8266WiFiClass::forceSleepWake()
+  {
+  simAdvanceUs(1000);
+  return true;
+  }
+
+/*
+ * A DNS round trip, unless the name is already an address. The broker stand-in
+ * answers to any name.
+ */
+int ESP8266WiFiClass::hostByName(const char* name, IPAddress& result, uint32_t timeoutMs)
+  {
+  if (result.fromString(name))
+    return 1;
+  if (status()!=WL_CONNECTED)
+    {
+    simAdvanceUs((uint64_t)timeoutMs*1000);
+    return 0;
+    }
+  simTransmit(40);
+  simAdvanceUs((uint64_t)sim->model.dnsMs*1000);
+  result=IPAddress(10,0,0,2);
+  return 1;
+  }
+
+bool WiFiClient::connected()
+  {
+  return WiFi.status()==WL_CONNECTED;
+  }
+
+/********************** SNTP **********************/
+
+static char sntpServer[64];
+static uint64_t sntpAnswerUs=UINT64_MAX; // when the answer arrives
+
+void sntp_setservername(unsigned char idx, char* server)
+  {
+  if (idx==0)
+    snprintf(sntpServer,sizeof(sntpServer),"%s",server);
+  }
+
+/*
+ * Look up the server and send the request. Nothing comes back without the network.
+ */
+void sntp_init()
+  {
+  sntpAnswerUs=UINT64_MAX;
+  if (WiFi.status()!=WL_CONNECTED)
+    return;
+  IPAddress literal;
+  uint64_t delayUs=(uint64_t)sim->model.rttMs*1000;
+  if (!literal.fromString(sntpServer))
+    {
+    simTransmit(40);
+    delayUs+=(uint64_t)sim->model.dnsMs*1000;
+    }
+  simTransmit(76); // NTP request in UDP
+  sntpAnswerUs=sim->nowUs+delayUs;
+  sim->stats.timeSyncs++;
+  }
+
+void sntp_stop()
+  {
+  sntpAnswerUs=UINT64_MAX;
+  }
+
+uint32_t sntp_get_current_timestamp()
+  {
+  simAdvanceUs(SIM_CALL_US);
+  if (sim->nowUs<sntpAnswerUs)
+    return 0;
+  return (uint32_t)(SIM_EPOCH_S+sim->nowUs/1000000);
+  }
+
+/********************** MQTT **********************/
+
+bool PubSubClient::connect(const char* id, const char* user, const char* pass)
+  {
+  return connect(id,user,pass,NULL,0,false,NULL,true);
+  }
+
+/*
+ * TCP handshake, then CONNECT and CONNACK. A dead broker costs brokerDownMs, or
+ * the client's timeout if that's shorter.
+ */
+bool PubSubClient::connect(const char* id, const char* user, const char* pass, const char* willTopic, uint8_t willQos, bool willRetain, const char* willMessage, bool cleanSession)
+  {
+  (void)willQos;
+  (void)willRetain;
+  if (WiFi.status()!=WL_CONNECTED)
+    {
+    mqttState=MQTT_CONNECT_FAILED;
+    return false;
+    }
+  IPAddress literal;
+  if (host!=NULL && !literal.fromString(host))
+    {
+    simTransmit(40); // DNS query
+    simAdvanceUs((uint64_t)sim->model.dnsMs*1000);
+    }
+  simTransmit(60); // SYN
+  if (!sim->brokerUp)
+    {
+    simAdvanceUs((uint64_t)min((unsigned long)sim->model.brokerDownMs,client->getTimeout())*1000);
+    sim->stats.mqttFailures++;
+    mqttState=MQTT_CONNECT_FAILED;
+    return false;
+    }
+  simAdvanceUs((uint64_t)sim->model.rttMs*1000);
+  size_t length=14+strlen(id)+(user ? strlen(user)+2 : 0)+(pass ? strlen(pass)+2 : 0);
+  if (willTopic)
+    length+=strlen(willTopic)+strlen(willMessage)+4;
+  simTransmit(length);
+  simAdvanceUs((uint64_t)sim->model.rttMs*1000);
+
+  //another device still connected with this ID gets knocked off
+  SimSession* session=simSession(id,true);
+  if (session->device!=-1 && session->device!=sim->device && session->connectedUntilUs>sim->nowUs)
+    simBroker->evictions++;
+  session->device=sim->device;
+  session->connectedUntilUs=UINT64_MAX;
+  snprintf(sim->clientId,sizeof(sim->clientId),"%s",id);
+  simBroker->connects++;
+  simBrokerSecond(sim->nowUs)->connects++;
+  if (cleanSession)
+    {
+    session->subscriptionCount=0;
+    sim->inboxCount=0;
+    }
+
+  //a broker that hands out wake slots sends each new client its slot as a command
+  if (sim->model.slotStepMs>0 && !session->slotSent && sim->inboxCount<SIM_INBOX_SIZE)
+    {
+    SimMessage* m=&sim->inbox[sim->inboxCount++];
+    m->deliverUs=sim->nowUs+(uint64_t)sim->model.rttMs*1000;
+    snprintf(m->topic,sizeof(m->topic),"slot");
+    m->length=snprintf((char*)m->payload,sizeof(m->payload),"slot=%llu",
+      (unsigned long long)(session-simBroker->sessions)*sim->model.slotStepMs/1000);
+    session->slotSent=true;
+    }
+  sim->stats.mqttConnects++;
+  isConnected=true;
+  mqttState=MQTT_CONNECTED;
+  return true;
+  }
+
+void PubSubClient::disconnect()
+  {
+  if (isConnected)
+    {
+    simTransmit(2);
+    SimSession* session=simSession(sim->clientId,false);
+    if (session!=NULL && session->device==sim->device)
+      session->connectedUntilUs=sim->nowUs;
+    }
+  isConnected=false;
+  mqttState=MQTT_DISCONNECTED;
+  }
+
+bool PubSubClient::connected()
+  {
+  if (isConnected && WiFi.status()!=WL_CONNECTED)
+    {
+    isConnected=false;
+    mqttState=MQTT_CONNECTION_LOST;
+    }
+  return isConnected;
+  }
+
+/*
+ * Hand a message to the broker, and queue it back to us if we are subscribed.
+ */
+bool PubSubClient::deliver(const char* topic, const uint8_t* payload, unsigned int length)
+  {
+  sim->stats.publishes++;
+  sim->stats.publishBytes+=length+strlen(topic)+4;
+  if (!sim->published)
+    sim->stats.toPublishUs+=simWakeUs();
+  sim->published=true;
+
+  //past what the broker can handle in a second, messages wait their turn
+  SimBrokerSecond* second=simBrokerSecond(sim->nowUs);
+  second->messages++;
+  simBroker->messages++;
+  if (!sim->reported)
+    {
+    uint64_t queuedUs=0;
+    if (second->messages>sim->model.brokerRate)
+      queuedUs=(uint64_t)(second->messages-sim->model.brokerRate)*1000000/max(sim->model.brokerRate,1u);
+    uint64_t latencyUs=simWakeUs()+(uint64_t)sim->model.rttMs*500+queuedUs;
+    simBroker->latencyCount++;
+    simBroker->latencySumUs+=latencyUs;
+    simBroker->latencyMaxUs=max(simBroker->latencyMaxUs,latencyUs);
+    sim->reported=true;
+    }
+
+  SimSession* session=simSession(sim->clientId,false);
+  for (int i=0; session!=NULL && i<session->subscriptionCount; i++)
+    {
+    const char* sub=session->subscriptions[i];
+    size_t n=strlen(sub);
+    bool match=strcmp(sub,topic)==0 || (n>0 && sub[n-1]=='#' && strncmp(sub,topic,n-1)==0);
+    if (match && sim->inboxCount<SIM_INBOX_SIZE)
+      {
+      SimMessage* m=&sim->inbox[sim->inboxCount++];
+      m->deliverUs=sim->nowUs+(uint64_t)sim->model.rttMs*1000;
+      snprintf(m->topic,sizeof(m->topic),"%s",topic);
+      m->length=min(length,(unsigned int)sizeof(m->payload)-1);
+      memcpy(m->payload,payload,m->length);
+      break;
+      }
+    }
+  return true;
+  }
+
+bool PubSubClient::publish(const char* topic, const char* payload, bool retained)
+  {
+  return publish(topic,(const uint8_t*)payload,payload ? strlen(payload) : 0,retained);
+  }
+
+bool PubSubClient::publish(const char* topic, const uint8_t* payload, unsigned int plength, bool retained)
+  {
+  (void)retained;
+  if (!connected() || 5+2+strlen(topic)+plength>bufferSize)
+    {
+    sim->stats.failedPublishes++;
+    return false;
+    }
+  simTransmit(5+2+strlen(topic)+plength);
+  return deliver(topic,payload,plength);
+  }
+
+bool PubSubClient::beginPublish(const char* topic, unsigned int plength, bool retained)
+  {
+  (void)retained;
+  if (!connected())
+    return false;
+  snprintf(pendingTopic,sizeof(pendingTopic),"%s",topic);
+  pendingLength=plength;
+  pendingWritten=0;
+  simTransmit(5+2+strlen(topic));
+  return true;
+  }
+
+size_t PubSubClient::write(uint8_t c)
+  {
+  return write(&c,1);
+  }
+
+size_t PubSubClient::write(const uint8_t* buf, size_t size)
+  {
+  if (!connected())
+    return 0;
+  if (pendingWritten<sizeof(pendingPayload))
+    memcpy(pendingPayload+pendingWritten,buf,min(size,sizeof(pendingPayload)-pendingWritten));
+  pendingWritten+=size;
+  simTransmit(size);
+  return size;
+  }
+
+int PubSubClient::endPublish()
+  {
+  if (!connected())
+    return 0;
+  deliver(pendingTopic,pendingPayload,pendingWritten);
+  return pendingWritten==pendingLength ? 1 : 0;
+  }
+
+bool PubSubClient::subscribe(const char* topic, uint8_t qos)
+  {
+  (void)qos;
+  if (!connected())
+    return false;
+  simTransmit(5+2+strlen(topic)+1);
+  sim->stats.subscribes++;
+  SimSession* session=simSession(sim->clientId,true);
+  for (int i=0; i<session->subscriptionCount; i++)
+    {
+    if (strcmp(session->subscriptions[i],topic)==0)
+      return true;
+    }
+  if (session->subscriptionCount<4)
+    snprintf(session->subscriptions[session->subscriptionCount++],SIM_TOPIC_SIZE,"%s",topic);
+  return true;
+  }
+
+bool PubSubClient::unsubscribe(const char* topic)
+  {
+  if (!connected())
+    return false;
+  simTransmit(5+2+strlen(topic));
+  SimSession* session=simSession(sim->clientId,true);
+  for (int i=0; i<session->subscriptionCount; i++)
+    {
+    if (strcmp(session->subscriptions[i],topic)==0)
+      {
+      session->subscriptionCount--;
+      memmove(session->subscriptions[i],session->subscriptions[i+1],(session->subscriptionCount-i)*SIM_TOPIC_SIZE);
+      break;
+      }
+    }
+  return true;
+  }
+
+/*
+ * Deliver whatever the broker has sent us by now.
+ */
+bool PubSubClient::loop()
+  {
+  simAdvanceUs(50);
+  if (!connected())
+    return false;
+  for (int i=0; i<sim->inboxCount; )
+    {
+    if (sim->inbox[i].deliverUs<=sim->nowUs)
+      {
+      SimMessage m=sim->inbox[i];
+      sim->inboxCount--;
+      memmove(&sim->inbox[i],&sim->inbox[i+1],(sim->inboxCount-i)*sizeof(SimMessage));
+      m.payload[m.length]=0;
+      if (5+2+strlen(m.topic)+m.length>bufferSize) //the real client reads it and throws it away
+        continue;
+      if (callback)
+        callback(m.topic,m.payload,m.length);
+      }
+    else
+      i++;
+    }
+  return true;
+  }
+
+/********************** Broker **********************/
+
+/*
+ * The session the broker keeps for a client ID, made if asked for and not there.
+ */
+SimSession* simSession(const char* clientId, bool create)
+  {
+  for (int i=0; i<simBroker->sessionCount; i++)
+    {
+    if (strcmp(simBroker->sessions[i].clientId,clientId)==0)
+      return &simBroker->sessions[i];
+    }
+  if (!create)
+    return NULL;
+  if (simBroker->sessionCount>=SIM_BROKER_SESSIONS)
+    {
+    fprintf(stderr,"The broker is out of sessions\n");
+    abort();
+    }
+  SimSession* session=&simBroker->sessions[simBroker->sessionCount++];
+  memset(session,0,sizeof(*session));
+  snprintf(session->clientId,sizeof(session->clientId),"%s",clientId);
+  session->device=-1;
+  return session;
+  }
+
+static void foldSecond(SimBrokerSecond* second)
+  {
+  if (second->associations==0 && second->connects==0 && second->messages==0)
+    return;
+  simBroker->busySeconds++;
+  simBroker->peakAssociations=max(simBroker->peakAssociations,second->associations);
+  simBroker->peakConnects=max(simBroker->peakConnects,second->connects);
+  simBroker->peakMessages=max(simBroker->peakMessages,second->messages);
+  second->associations=0;
+  second->connects=0;
+  second->messages=0;
+  }
+
+/*
+ * The traffic counts for the second holding us. A second that has dropped out of the
+ * window is folded into the peaks first.
+ */
+SimBrokerSecond* simBrokerSecond(uint64_t us)
+  {
+  uint64_t now=us/1000000;
+  SimBrokerSecond* second=&simBroker->window[now%SIM_BROKER_WINDOW];
+  if (second->second!=now)
+    {
+    foldSecond(second);
+    second->second=now;
+    }
+  return second;
+  }
+
+/*
+ * Fold everything still in the window into the peaks, at the end of a run.
+ */
+void simBrokerFlush()
+  {
+  for (int i=0; i<SIM_BROKER_WINDOW; i++)
+    foldSecond(&simBroker->window[i]);
+  }
@@ -0,0 +1,189 @@
+/**
+ * Host stand-in for the parts of the ESP8266 Arduino core that the firmware uses.
+ * Time is virtual: it only moves when the firmware waits, talks or computes, and
+ * every step is charged to the energy model in sim.h.
+ */
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+#include <functional>
+#include <string>
+#include "sim.h"
+#include "IPAddress.h"
+
+using std::min;
+using std::max;
+
+typedef bool boolean;
+typedef uint8_t byte;
+typedef uint8_t uint8;
+typedef int8_t int8;
+typedef uint16_t uint16;
+typedef int16_t int16;
+typedef uint32_t uint32;
+typedef int32_t int32;
+
+#define HIGH 1
+#define LOW 0
+#define INPUT 0
+#define OUTPUT 1
+#define DEC 10
+#define HEX 16
+
+#define ADC_VCC 1
+#define ADC_TOUT 0
+#define ADC_MODE(mode) int __get_adc_mode(void) {return (int)(mode);}
+
+inline void pinMode(uint8_t, uint8_t) {}
+inline void digitalWrite(uint8_t, uint8_t) {}
+inline void wifi_status_led_uninstall() {}
+inline uint8_t system_get_cpu_freq() {return 80;}
+uint32_t system_get_rtc_time();
+uint32_t system_rtc_clock_cali_proc();
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+void yield();
+
+long random(long howBig);
+long random(long howSmall, long howBig);
+void randomSeed(unsigned long seed);
+
+#define constrain(amt,low,high) ((amt)<(low)?(low):((amt)>(high)?(high):(amt)))
+
+inline long map(long x, long in_min, long in_max, long out_min, long out_max)
+  {
+  return (x - in_min) * (out_max - out_min) / (in_max - in_min) + out_min;
+  }
+
+class String
+  {
+  public:
+  String() {}
+  String(const char* s) : str(s ? s : "") {}
+  String(const std::string& s) : str(s) {}
+  String(char c) : str(1,c) {}
+  String(int value, unsigned char base=DEC) {fromNumber((long)value,base);}
+  String(unsigned int value, unsigned char base=DEC) {fromNumber((long)value,base);}
+  String(long value, unsigned char base=DEC) {fromNumber(value,base);}
+  String(unsigned long value, unsigned char base=DEC) {fromNumber((long)value,base);}
+  String(float value, unsigned char decimals=2) {char buf[32]; snprintf(buf,sizeof(buf),"%.*f",decimals,value); str=buf;}
+  String(double value, unsigned char decimals=2) {char buf[32]; snprintf(buf,sizeof(buf),"%.*f",decimals,value); str=buf;}
+
+  const char* c_str() const {return str.c_str();}
+  unsigned int length() const {return str.length();}
+  bool reserve(unsigned int size) {str.reserve(size); return true;}
+  char operator[](unsigned int i) const {return str[i];}
+  String& operator+=(const String& s) {str+=s.str; return *this;}
+  String& operator+=(const char* s) {str+=s; return *this;}
+  String& operator+=(char c) {str+=c; return *this;}
+  bool operator==(const char* s) const {return str==s;}
+  bool operator==(const String& s) const {return str==s.str;}
+  friend String operator+(const String& a, const String& b) {return String(a.str+b.str);}
+  friend String operator+(const char* a, const String& b) {return String(std::string(a)+b.str);}
+  friend String operator+(const String& a, const char* b) {return String(a.str+b);}
+
+  private:
+  void fromNumber(long value, unsigned char base)
+    {
+    char buf[34];
+    if (base==HEX)
+      snprintf(buf,sizeof(buf),"%lx",value);
+    else
+      snprintf(buf,sizeof(buf),"%ld",value);
+    str=buf;
+    }
+  std::string str;
+  };
+
+enum SerialConfig {SERIAL_8N1};
+enum SerialMode {SERIAL_FULL, SERIAL_RX_ONLY, SERIAL_TX_ONLY};
+
+class HardwareSerial
+  {
+  public:
+  void begin(unsigned long speed, SerialConfig config=SERIAL_8N1, SerialMode mode=SERIAL_FULL) {(void)config; baud=speed; started=true; serialMode=mode;}
+  void end() {started=false;}
+  void setTimeout(unsigned long) {}
+  operator bool() const {return true;}
+  int available();
+  int read();
+  void flush() {}
+
+  size_t write(const char* s, size_t len);
+  size_t write(uint8_t c) {char ch=(char)c; return write(&ch,1);}
+  size_t print(const char* s) {return write(s,strlen(s));}
+  size_t print(const String& s) {return print(s.c_str());}
+  size_t print(char c) {return write(&c,1);}
+  size_t print(int n, int base=DEC) {return print(String((long)n,(unsigned char)base));}
+  size_t print(unsigned int n, int base=DEC) {return print(String((unsigned long)n,(unsigned char)base));}
+  size_t print(long n, int base=DEC) {return print(String(n,(unsigned char)base));}
+  size_t print(unsigned long n, int base=DEC) {return print(String(n,(unsigned char)base));}
+  size_t print(double n, int digits=2) {return print(String(n,(unsigned char)digits));}
+  size_t print(const IPAddress& a) {return print(a.toString());}
+  template <typename T> size_t println(const T& x) {size_t n=print(x); return n+print("\r\n");}
+  template <typename T> size_t println(const T& x, int fmt) {size_t n=print(x,fmt); return n+print("\r\n");}
+  size_t println() {return print("\r\n");}
+  size_t printf(const char* format, ...) __attribute__((format(printf,2,3)));
+
+  private:
+  unsigned long baud=9600;
+  bool started=false;
+  SerialMode serialMode=SERIAL_FULL;
+  };
+
+extern HardwareSerial Serial;
+
+enum RFMode
+  {
+  RF_DEFAULT=0,
+  RF_CAL=1,
+  RF_NO_CAL=2,
+  RF_DISABLED=4
+  };
+#define WAKE_RF_DEFAULT RF_DEFAULT
+#define WAKE_RFCAL RF_CAL
+#define WAKE_NO_RFCAL RF_NO_CAL
+#define WAKE_RF_DISABLED RF_DISABLED
+
+enum rst_reason
+  {
+  REASON_DEFAULT_RST=0,
+  REASON_WDT_RST=1,
+  REASON_EXCEPTION_RST=2,
+  REASON_SOFT_WDT_RST=3,
+  REASON_SOFT_RESTART=4,
+  REASON_DEEP_SLEEP_AWAKE=5,
+  REASON_EXT_SYS_RST=6
+  };
+
+struct rst_info
+  {
+  uint32_t reason;
+  };
+
+class EspClass
+  {
+  public:
+  uint16_t getVcc();
+  uint32_t getChipId();
+  void restart() __attribute__((noreturn));
+  void deepSleep(uint64_t timeUs, RFMode mode=RF_DEFAULT) __attribute__((noreturn));
+  void deepSleepInstant(uint64_t timeUs, RFMode mode=RF_DEFAULT) __attribute__((noreturn)) {deepSleep(timeUs,mode);}
+  uint64_t deepSleepMax() {return 0x0000000FFFFFFFFFULL/1000ULL*1000ULL/4ULL;} // about 3.5 hours on a real part
+  bool rtcUserMemoryRead(uint32_t offset, uint32_t* data, size_t size);
+  bool rtcUserMemoryWrite(uint32_t offset, uint32_t* data, size_t size);
+  rst_info* getResetInfoPtr();
+  uint32_t getFreeHeap() {return 40000;}
+  };
+
+extern EspClass ESP;
@@ -0,0 +1,43 @@
+/**
+ * Host stand-in for ArduinoOTA. Updates never arrive in the simulator.
+ */
+#pragma once
+
+#include "Arduino.h"
+
+#define U_FLASH 0
+#define U_FS 100
+#define U_SPIFFS U_FS
+
+typedef enum
+  {
+  OTA_AUTH_ERROR,
+  OTA_BEGIN_ERROR,
+  OTA_CONNECT_ERROR,
+  OTA_RECEIVE_ERROR,
+  OTA_END_ERROR
+  } ota_error_t;
+
+class ArduinoOTAClass
+  {
+  public:
+  void setPort(uint16_t) {}
+  void setHostname(const char*) {}
+  void setPassword(const char*) {}
+  void setPasswordHash(const char*) {}
+  void onStart(std::function<void(void)> fn) {startCallback=fn;}
+  void onEnd(std::function<void(void)> fn) {endCallback=fn;}
+  void onProgress(std::function<void(unsigned int, unsigned int)> fn) {progressCallback=fn;}
+  void onError(std::function<void(ota_error_t)> fn) {errorCallback=fn;}
+  void begin(bool useMDNS=true) {(void)useMDNS; simAdvanceUs(2000);} // mDNS announcement
+  void handle() {}
+  int getCommand() {return U_FLASH;}
+
+  private:
+  std::function<void(void)> startCallback;
+  std::function<void(void)> endCallback;
+  std::function<void(unsigned int, unsigned int)> progressCallback;
+  std::function<void(ota_error_t)> errorCallback;
+  };
+
+extern ArduinoOTAClass ArduinoOTA;
@@ -0,0 +1,34 @@
+/**
+ * Host stand-in for the ESP8266 EEPROM emulation. The contents live in the shared
+ * simulator state so they survive resets, and every commit is counted as a sector erase.
+ */
+#pragma once
+
+#include "Arduino.h"
+
+class EEPROMClass
+  {
+  public:
+  void begin(size_t size);
+  bool commit();
+  void end() {}
+  template <typename T> T& get(int address, T& t)
+    {
+    memcpy((void*)&t, buffer+address, sizeof(T));
+    return t;
+    }
+  template <typename T> const T& put(int address, const T& t)
+    {
+    memcpy(buffer+address, (const void*)&t, sizeof(T));
+    return t;
+    }
+  uint8_t read(int address) {return buffer[address];}
+  void write(int address, uint8_t value) {buffer[address]=value;}
+  size_t length() {return size;}
+
+  private:
+  uint8_t buffer[SIM_EEPROM_BYTES];
+  size_t size=0;
+  };
+
+extern EEPROMClass EEPROM;
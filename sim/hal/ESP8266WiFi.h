@@ -0,0 +1,118 @@
+/**
+ * Host stand-in for the ESP8266 WiFi station. Association time depends on whether
+ * the channel and BSSID are given and whether DHCP is needed; the access point is
+ * up or down for a whole wake as decided by the harness. Event callbacks run during
+ * delay() and yield(), as the SDK runs them.
+ */
+#pragma once
+
+#include <memory>
+#include "Arduino.h"
+
+typedef enum
+  {
+  WL_IDLE_STATUS=0,
+  WL_NO_SSID_AVAIL=1,
+  WL_SCAN_COMPLETED=2,
+  WL_CONNECTED=3,
+  WL_CONNECT_FAILED=4,
+  WL_CONNECTION_LOST=5,
+  WL_WRONG_PASSWORD=6,
+  WL_DISCONNECTED=7
+  } wl_status_t;
+
+typedef enum
+  {
+  WIFI_OFF=0,
+  WIFI_STA=1,
+  WIFI_AP=2,
+  WIFI_AP_STA=3
+  } WiFiMode_t;
+
+typedef enum
+  {
+  WIFI_NONE_SLEEP=0,
+  WIFI_LIGHT_SLEEP=1,
+  WIFI_MODEM_SLEEP=2
+  } WiFiSleepType_t;
+
+typedef enum
+  {
+  WIFI_DISCONNECT_REASON_UNSPECIFIED=1,
+  WIFI_DISCONNECT_REASON_NO_AP_FOUND=201
+  } WiFiDisconnectReason;
+
+struct WiFiEventStationModeGotIP
+  {
+  IPAddress ip;
+  IPAddress mask;
+  IPAddress gw;
+  };
+
+struct WiFiEventStationModeDisconnected
+  {
+  String ssid;
+  uint8_t bssid[6];
+  WiFiDisconnectReason reason;
+  };
+
+// Keeps a callback registered. Only the latest one of each kind is kept here.
+typedef std::shared_ptr<int> WiFiEventHandler;
+
+class ESP8266WiFiClass
+  {
+  public:
+  bool mode(WiFiMode_t m);
+  bool persistent(bool) {return true;}
+  bool config(IPAddress local, IPAddress gateway, IPAddress subnet, IPAddress dns1=IPAddress(), IPAddress dns2=IPAddress());
+  wl_status_t begin(const char* ssid, const char* passphrase=NULL, int32_t channel=0, const uint8_t* bssid=NULL, bool connect=true);
+  wl_status_t status();
+  bool disconnect(bool wifioff=false);
+  bool isConnected() {return status()==WL_CONNECTED;}
+  IPAddress localIP() {return status()==WL_CONNECTED ? local : IPAddress();}
+  IPAddress gatewayIP() {return gateway;}
+  IPAddress subnetMask() {return subnet;}
+  IPAddress dnsIP(uint8_t n=0) {return n==0 ? dns : IPAddress();}
+  uint8_t* BSSID() {return bssid;}
+  int32_t channel() {return status()==WL_CONNECTED ? sim->model.channel : 0;}
+  int32_t RSSI() {return status()==WL_CONNECTED ? -60-(int32_t)(simRandom()%15) : 31;}
+  uint8_t* macAddress(uint8_t* mac);
+  bool forceSleepBegin(uint32_t sleepUs=0);
+  bool forceSleepWake();
+  bool setSleepMode(WiFiSleepType_t type, uint8_t listenInterval=0) {(void)listenInterval; sleepType=type; return true;}
+  WiFiSleepType_t getSleepMode() {return sleepType;}
+  int hostByName(const char* name, IPAddress& result, uint32_t timeoutMs=10000);
+  WiFiEventHandler onStationModeGotIP(std::function<void(const WiFiEventStationModeGotIP&)> fn) {gotIpCallback=fn; return std::make_shared<int>(0);}
+  WiFiEventHandler onStationModeDisconnected(std::function<void(const WiFiEventStationModeDisconnected&)> fn) {disconnectedCallback=fn; return std::make_shared<int>(0);}
+  void runEvents();
+
+  private:
+  void joined();
+  std::function<void(const WiFiEventStationModeGotIP&)> gotIpCallback;
+  std::function<void(const WiFiEventStationModeDisconnected&)> disconnectedCallback;
+  bool gotIpPending=false;   //joined, and the callback hasn't run yet
+  uint64_t giveUpAtUs=UINT64_MAX; //when the SDK reports the access point can't be found
+  uint64_t giveUpEveryUs=0;  //and again this often while it keeps trying
+  wl_status_t state=WL_DISCONNECTED;
+  WiFiMode_t wifiMode=WIFI_OFF;
+  uint64_t connectAtUs=0; //when the association in progress will complete
+  bool staticConfig=false;
+  bool fast=false;
+  WiFiSleepType_t sleepType=WIFI_MODEM_SLEEP;
+  IPAddress local, gateway, subnet, dns;
+  uint8_t bssid[6]={0,0,0,0,0,0};
+  };
+
+extern ESP8266WiFiClass WiFi;
+
+class WiFiClient
+  {
+  public:
+  bool connected();
+  void stop() {}
+  void setTimeout(unsigned long ms) {timeoutMs=ms;}
+  unsigned long getTimeout() {return timeoutMs;}
+
+  private:
+  unsigned long timeoutMs=5000;
+  };
@@ -0,0 +1,37 @@
+/**
+ * Host stand-in for the Arduino IPAddress class.
+ */
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+class String;
+
+class IPAddress
+  {
+  public:
+  IPAddress() {}
+  IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d) {addr=a | (b<<8) | (c<<16) | ((uint32_t)d<<24);}
+  IPAddress(uint32_t a) : addr(a) {}
+  operator uint32_t() const {return addr;}
+  bool operator==(const IPAddress& other) const {return addr==other.addr;}
+  bool operator!=(const IPAddress& other) const {return addr!=other.addr;}
+  uint8_t operator[](int i) const {return (addr>>(8*i)) & 0xff;}
+  bool isSet() const {return addr!=0;}
+  bool fromString(const char* str)
+    {
+    unsigned a,b,c,d;
+    char extra;
+    if (str==NULL || sscanf(str,"%u.%u.%u.%u%c",&a,&b,&c,&d,&extra)!=4 || a>255 || b>255 || c>255 || d>255)
+      return false;
+    addr=a | (b<<8) | (c<<16) | (d<<24);
+    return true;
+    }
+  String toString() const;
+
+  private:
+  uint32_t addr=0;
+  };
+
@@ -0,0 +1,65 @@
+/**
+ * Host stand-in for LittleFS. Files live in a scratch directory on the host, so they
+ * survive resets the way flash does. Writes are charged as whole flash blocks being
+ * erased and rewritten, which is what copy-on-write costs on the real part.
+ */
+#pragma once
+
+#include <memory>
+#include <vector>
+#include "Arduino.h"
+
+enum SeekMode
+  {
+  SeekSet=0,
+  SeekCur=1,
+  SeekEnd=2
+  };
+
+class File
+  {
+  public:
+  File() {}
+  explicit File(FILE* f) : fp(f,fclose) {}
+  operator bool() const {return (bool)fp;}
+  size_t write(const uint8_t* buf, size_t size);
+  size_t read(uint8_t* buf, size_t size);
+  bool seek(uint32_t pos, SeekMode mode=SeekSet);
+  size_t size();
+  void close() {fp.reset();}
+
+  private:
+  std::shared_ptr<FILE> fp;
+  };
+
+class Dir
+  {
+  public:
+  bool next() {return ++index<(int)names.size();}
+  String fileName() {return String(names[index]);}
+  size_t fileSize() {return sizes[index];}
+
+  private:
+  friend class FS;
+  std::vector<std::string> names;
+  std::vector<size_t> sizes;
+  int index=-1;
+  };
+
+class FS
+  {
+  public:
+  bool begin();
+  void end() {mounted=false;}
+  File open(const char* path, const char* mode);
+  bool exists(const char* path);
+  bool remove(const char* path);
+  bool mkdir(const char* path);
+  Dir openDir(const char* path);
+
+  private:
+  std::string hostPath(const char* path);
+  bool mounted=false;
+  };
+
+extern FS LittleFS;
@@ -0,0 +1,70 @@
+/**
+ * Host stand-in for knolleary/PubSubClient. The broker is simulated: connecting
+ * and subscribing cost round trips, publishing costs airtime, and messages on
+ * topics we subscribe to come back after a round trip.
+ */
+#pragma once
+
+#include "Arduino.h"
+#include "ESP8266WiFi.h"
+
+#define MQTT_CONNECTION_TIMEOUT     -4
+#define MQTT_CONNECTION_LOST        -3
+#define MQTT_CONNECT_FAILED         -2
+#define MQTT_DISCONNECTED           -1
+#define MQTT_CONNECTED               0
+#define MQTT_CONNECT_BAD_PROTOCOL    1
+#define MQTT_CONNECT_BAD_CLIENT_ID   2
+#define MQTT_CONNECT_UNAVAILABLE     3
+#define MQTT_CONNECT_BAD_CREDENTIALS 4
+#define MQTT_CONNECT_UNAUTHORIZED    5
+
+#define MQTT_MAX_PACKET_SIZE 256
+#define MQTT_CALLBACK_SIGNATURE std::function<void(char*, uint8_t*, unsigned int)> callback
+
+class PubSubClient
+  {
+  public:
+  PubSubClient(WiFiClient& client) : client(&client) {}
+
+  PubSubClient& setServer(const char* domain, uint16_t port) {host=domain; this->port=port; return *this;}
+  PubSubClient& setServer(IPAddress ip, uint16_t port) {hostIP=ip; host=NULL; this->port=port; return *this;}
+  PubSubClient& setCallback(MQTT_CALLBACK_SIGNATURE) {this->callback=callback; return *this;}
+  PubSubClient& setKeepAlive(uint16_t keepAlive) {this->keepAlive=keepAlive; return *this;}
+  PubSubClient& setSocketTimeout(uint16_t timeout) {socketTimeout=timeout; return *this;}
+  bool setBufferSize(uint16_t size) {bufferSize=size; return true;}
+  uint16_t getBufferSize() {return bufferSize;}
+
+  bool connect(const char* id, const char* user=NULL, const char* pass=NULL);
+  bool connect(const char* id, const char* user, const char* pass, const char* willTopic, uint8_t willQos, bool willRetain, const char* willMessage, bool cleanSession=true);
+  void disconnect();
+  bool connected();
+  int state() {return mqttState;}
+
+  bool publish(const char* topic, const char* payload, bool retained=false);
+  bool publish(const char* topic, const uint8_t* payload, unsigned int plength, bool retained=false);
+  bool beginPublish(const char* topic, unsigned int plength, bool retained);
+  size_t write(uint8_t c);
+  size_t write(const uint8_t* buf, size_t size);
+  int endPublish();
+  bool subscribe(const char* topic, uint8_t qos=0);
+  bool unsubscribe(const char* topic);
+  bool loop();
+
+  private:
+  bool deliver(const char* topic, const uint8_t* payload, unsigned int length);
+  WiFiClient* client;
+  MQTT_CALLBACK_SIGNATURE;
+  const char* host=NULL;
+  IPAddress hostIP;
+  uint16_t port=1883;
+  uint16_t keepAlive=15;
+  uint16_t socketTimeout=15;
+  uint16_t bufferSize=MQTT_MAX_PACKET_SIZE;
+  int mqttState=MQTT_DISCONNECTED;
+  bool isConnected=false;
+  unsigned int pendingLength=0; // for beginPublish()/endPublish()
+  unsigned int pendingWritten=0;
+  char pendingTopic[SIM_TOPIC_SIZE];
+  uint8_t pendingPayload[SIM_PAYLOAD_SIZE];
+  };
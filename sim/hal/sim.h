@@ -0,0 +1,207 @@
+/**
+ * State shared between the simulated ESP8266 (one child process per wake) and the
+ * simulator harness. Everything in here survives a simulated reset, the same way
+ * RTC memory, flash and the outside world survive a real one.
+ */
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+// What the chip is doing right now, for the energy model
+enum SimPhase
+  {
+  SIM_PHASE_BOOT,      // ROM bootloader and SDK init
+  SIM_PHASE_CPU,       // running, radio off
+  SIM_PHASE_ASSOC,     // radio receiving: scanning, associating, DHCP
+  SIM_PHASE_CONNECTED, // associated and idle, waiting on the network
+  SIM_PHASE_TX,        // transmitting
+  SIM_PHASE_LIGHT,     // light sleep, waking for access point beacons (averaged)
+  SIM_PHASE_SLEEP,     // deep sleep
+  SIM_PHASE_COUNT
+  };
+
+// How a wake ended
+enum SimExit
+  {
+  SIM_EXIT_NONE,
+  SIM_EXIT_SLEEP,
+  SIM_EXIT_RESTART,
+  SIM_EXIT_TIMEOUT, // stayed awake longer than maxAwakeMs
+  };
+
+#define SIM_RTC_BYTES 512
+#define SIM_EEPROM_BYTES 4096
+#define SIM_SERIAL_IN_BYTES 4096
+#define SIM_TOPIC_SIZE 160
+#define SIM_PAYLOAD_SIZE 1024
+#define SIM_INBOX_SIZE 8
+#define SIM_CLIENT_ID_SIZE 32
+#define SIM_FLEET_MAX 1024
+#define SIM_BROKER_SESSIONS (2*SIM_FLEET_MAX) // room for every device changing its ID once
+#define SIM_RTC_PERIOD_US 6.4 // RTC clock period while awake, as the calibration measures it
+#define SIM_EPOCH_S 1700000000ULL // Unix time when the virtual clock reads zero
+#define SIM_BROKER_WINDOW 4096 // seconds of traffic counts kept while late wakes may still add to them
+
+// The tunable parts of the model. All can be set from the command line.
+typedef struct
+  {
+  double current_mA[SIM_PHASE_COUNT];
+  uint32_t bootMs;       // power-on to setup()
+  uint32_t scanMs;       // full scan plus association
+  uint32_t fastAssocMs;  // association when channel and BSSID are given
+  uint32_t dhcpMs;       // DHCP, skipped with a static configuration
+  uint32_t dnsMs;        // broker name lookup
+  uint32_t rttMs;        // round trip to the broker
+  uint32_t txBytesPerMs; // effective airtime throughput
+  double apUpPct;        // chance the access point is reachable on a given wake
+  double brokerUpPct;    // chance the broker is reachable on a given wake
+  double sessionLossPct; // chance the broker has forgotten our session on a given wake
+  uint32_t brokerRate;   // messages a second the broker handles before they queue
+  uint32_t apContentionMs; // added to an association for each other one in the same second
+  uint32_t slotStepMs;   // the broker assigns wake slots this far apart, zero if it doesn't
+  double rtcDriftPct;    // deep sleep runs this much longer than asked, the RTC oscillator running slow
+  uint64_t outageStart;  // run wake at which the access point goes away
+  uint64_t outageWakes;  // and how many wakes it stays away
+  double capacity_mAh;   // battery capacity
+  double internalOhms;   // battery internal resistance, for the voltage sag under load
+  double noiseCounts;    // ADC noise, peak
+  uint32_t brokerDownMs; // how long a connection attempt to a dead broker takes to fail
+  uint32_t maxAwakeMs;   // give up on a wake that lasts longer than this
+  uint8_t bssid[6];
+  uint8_t channel;
+  uint32_t seed;
+  int verbose;           // echo the firmware's Serial output
+  } SimModel;
+
+typedef struct
+  {
+  uint64_t wakes;
+  uint64_t restarts;
+  uint64_t timeouts;
+  uint64_t reportWakes;   // wakes that published at least one message
+  uint64_t publishes;
+  uint64_t publishBytes;
+  uint64_t failedPublishes;
+  uint64_t mqttConnects;
+  uint64_t mqttFailures;
+  uint64_t subscribes;
+  uint64_t wifiFull;      // associations that needed a scan
+  uint64_t wifiFast;      // associations with channel and BSSID given
+  uint64_t wifiFailures;
+  uint64_t eepromCommits;
+  uint64_t fsMounts;
+  uint64_t fsBlockWrites;  // flash blocks erased and rewritten by the file system
+  uint64_t fsBytesWritten;
+  uint64_t rfDisabledWakes;
+  uint64_t timeSyncs;
+  uint64_t intervals;     // wake to wake intervals measured, sleeps of at least 10 s only
+  uint64_t intervalUs;    // and their total
+  uint64_t serialBytes;
+  uint64_t awakeUs;
+  uint64_t toPublishUs;   // from the start of each reporting wake to its first publish, total
+  uint64_t phaseUs[SIM_PHASE_COUNT];
+  double phase_mAs[SIM_PHASE_COUNT]; // charge used in each phase, milliamp-seconds
+  double intervalSquares; // sum of the squared intervals, seconds squared
+  } SimStats;
+
+typedef struct
+  {
+  uint64_t deliverUs;
+  char topic[SIM_TOPIC_SIZE];
+  uint8_t payload[SIM_PAYLOAD_SIZE];
+  uint32_t length;
+  } SimMessage;
+
+typedef struct
+  {
+  SimModel model;
+  SimStats stats;
+  uint64_t nowUs;         // virtual wall clock
+  uint64_t wakeStartUs;   // when the current wake began
+  int phase;              // SimPhase while awake
+  uint64_t transitionUs;  // a phase change scheduled by the radio, e.g. association completing
+  int transitionPhase;
+  double batteryUsed_mAs; // never reset, drives the battery voltage
+  uint32_t chipId;
+  int resetReason;        // as reported by ESP.getResetInfoPtr()
+  int rfMode;             // RF mode this wake was started with
+  bool apUp;              // decided once per wake
+  bool brokerUp;
+  bool published;         // this wake published something
+  bool running;           // provisioning is over
+  int device;             // which one of the fleet this is
+  char clientId[SIM_CLIENT_ID_SIZE]; // what it last connected to the broker as
+  bool reported;          // the first message of this wake has reached the broker
+  int exitKind;           // SimExit
+  uint64_t sleepUs;
+  double rtcCycles;       // the RTC clock, which counts on through deep sleep
+  uint64_t lastWakeUs;    // when the previous wake started, if it ended in a deep sleep of 10 s or more
+  int nextRfMode;
+  uint32_t rng;
+  uint8_t rtcMem[SIM_RTC_BYTES];
+  uint8_t eeprom[SIM_EEPROM_BYTES];
+  char fsDir[256];        // host directory holding the file system
+  char serialIn[SIM_SERIAL_IN_BYTES]; // console input, consumed across wakes
+  uint32_t serialInLen;
+  uint32_t serialInPos;
+  uint32_t serialInLineEnd; // input up to here has been typed
+  uint64_t serialLineUs;    // when the last line was typed
+  SimMessage inbox[SIM_INBOX_SIZE]; // messages the broker will deliver to us
+  int inboxCount;
+  } SimShared;
+
+// What the broker keeps for a client ID. Two devices with the same ID share it.
+typedef struct
+  {
+  char clientId[SIM_CLIENT_ID_SIZE];
+  char subscriptions[4][SIM_TOPIC_SIZE];
+  int subscriptionCount;
+  int device;                // the device connected with this ID, -1 if none
+  uint64_t connectedUntilUs; // when that device's wake ends, or UINT64_MAX while it's running
+  bool slotSent;             // the broker has assigned this client a wake slot
+  } SimSession;
+
+// Broker traffic in one second of virtual time
+typedef struct
+  {
+  uint64_t second;
+  uint32_t associations; // with the access point
+  uint32_t connects;
+  uint32_t messages;
+  } SimBrokerSecond;
+
+// The broker stand-in, shared by the whole fleet. Wakes are run in the order they
+// start, so a device connecting can see who else is connected at the time.
+typedef struct
+  {
+  SimSession sessions[SIM_BROKER_SESSIONS];
+  int sessionCount;
+  SimBrokerSecond window[SIM_BROKER_WINDOW];
+  uint64_t connects;
+  uint64_t messages;
+  uint64_t evictions;      // connects that knocked off another device using the same ID
+  uint64_t busySeconds;    // seconds with any traffic
+  uint32_t peakAssociations; // most associations in one second
+  uint32_t peakConnects;   // most connects in one second
+  uint32_t peakMessages;   // most messages in one second
+  uint64_t latencyCount;   // wakes whose first message reached the broker
+  uint64_t latencySumUs;   // from the start of the wake to when the broker had it
+  uint64_t latencyMaxUs;
+  } SimBroker;
+
+extern SimShared *sim;
+extern SimBroker *simBroker;
+
+void simAdvanceUs(uint64_t us);
+void simSetPhase(int phase);
+void simTransmit(uint32_t bytes);
+void simEndWake(int exitKind);
+uint32_t simRandom();
+double simRandomUnit();
+double simBatteryVolts();
+uint64_t simWakeUs();
+void simTypeLine();
+SimSession* simSession(const char* clientId, bool create);
+SimBrokerSecond* simBrokerSecond(uint64_t us);
+void simBrokerFlush();
@@ -0,0 +1,12 @@
+/**
+ * Host stand-in for the SDK's SNTP client. The answer comes back a DNS lookup and a
+ * round trip after sntp_init(), as Unix time derived from the virtual clock.
+ */
+#pragma once
+
+#include "Arduino.h"
+
+void sntp_setservername(unsigned char idx, char* server);
+void sntp_init();
+void sntp_stop();
+uint32_t sntp_get_current_timestamp();
@@ -0,0 +1,488 @@
+/**
+ * Wake-cycle simulator. Runs the firmware on the host against the simulated HAL, one
+ * forked process per wake so that every reset really does clear RAM, and reports
+ * where the energy went and how long the battery would last.
+ *
+ * With --fleet, many devices share one broker stand-in. Their wakes are run in the
+ * order they start, and the broker reports connection storms, message rates,
+ * duplicate client ID evictions and how long reports take to reach it.
+ *
+ * Build with "pio run -e native", then run .pio/build/native/program --help
+ */
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <ftw.h>
+#include <stddef.h>
+#include <vector>
+#include "Arduino.h"
+
+void setup();
+void loop();
+
+static const char* phaseNames[SIM_PHASE_COUNT]={"boot","cpu","associate","connected","transmit","light","sleep"};
+
+static SimShared* fleet=NULL; //one per device, shared with the wake being run
+static int fleetSize=1;
+
+static void usage()
+  {
+  printf("Usage: program [options]\n"
+    "  --cycles N           wakes to simulate after provisioning (1000)\n"
+    "  --set key=value      send a configuration command on the console before the run, repeatable\n"
+    "  --capacity mAh       battery capacity (2500)\n"
+    "  --sleep-ua uA        deep sleep current (20)\n"
+    "  --light-ma mA        light sleep, averaged over beacon wakeups (1.2)\n"
+    "  --boot-ma mA         boot current (70)\n"
+    "  --cpu-ma mA          running with the radio off (17)\n"
+    "  --assoc-ma mA        scanning, associating and DHCP (75)\n"
+    "  --connected-ma mA    associated and idle (70)\n"
+    "  --tx-ma mA           transmitting (170)\n"
+    "  --boot-ms ms         power-on to setup() (90)\n"
+    "  --scan-ms ms         full scan and association (1800)\n"
+    "  --fast-ms ms         association with a known channel and BSSID (180)\n"
+    "  --dhcp-ms ms         DHCP (400)\n"
+    "  --rtt-ms ms          round trip to the broker (8)\n"
+    "  --ap-up pct          percent of wakes the access point is there (100)\n"
+    "  --broker-up pct      percent of wakes the broker is there (100)\n"
+    "  --session-loss pct   percent of wakes the broker has forgotten our session (0)\n"
+    "  --fleet n            devices sharing the broker (1)\n"
+    "  --spread s           seconds over which the fleet is powered on (0, all at once)\n"
+    "  --broker-rate n      messages a second the broker handles before they queue (1000)\n"
+    "  --broker-slots s     the broker spreads wake slots over a period of s seconds\n"
+    "  --ap-contention ms   added to an association for each other one in the same second (5)\n"
+    "  --rtc-drift pct      deep sleep runs this much longer than asked (0)\n"
+    "  --outage start,n     access point is gone for n wakes from run wake start\n"
+    "  --max-awake ms       end a wake that runs longer than this (60000)\n"
+    "  --chip-id n          chip ID of the simulated device (0x00c0ffee)\n"
+    "  --seed n             random seed (1)\n"
+    "  --verbose            show the firmware's console output\n");
+  }
+
+static void defaults(SimModel* m)
+  {
+  m->current_mA[SIM_PHASE_BOOT]=70;
+  m->current_mA[SIM_PHASE_CPU]=17;
+  m->current_mA[SIM_PHASE_ASSOC]=75;
+  m->current_mA[SIM_PHASE_CONNECTED]=70;
+  m->current_mA[SIM_PHASE_TX]=170;
+  m->current_mA[SIM_PHASE_LIGHT]=1.2;
+  m->current_mA[SIM_PHASE_SLEEP]=0.020;
+  m->bootMs=90;
+  m->scanMs=1800;
+  m->fastAssocMs=180;
+  m->dhcpMs=400;
+  m->dnsMs=15;
+  m->rttMs=8;
+  m->txBytesPerMs=500;
+  m->apUpPct=100;
+  m->brokerUpPct=100;
+  m->sessionLossPct=0;
+  m->brokerRate=1000;
+  m->apContentionMs=5;
+  m->capacity_mAh=2500;
+  m->internalOhms=0.3;
+  m->noiseCounts=12;
+  m->brokerDownMs=3000;
+  m->maxAwakeMs=60000;
+  static const uint8_t bssid[6]={0x02,0x11,0x22,0x33,0x44,0x55};
+  memcpy(m->bssid,bssid,6);
+  m->channel=6;
+  m->seed=1;
+  m->verbose=0;
+  }
+
+/*
+ * Run one wake, from reset to deep sleep or restart, in a child process.
+ */
+static bool runWake()
+  {
+  sim->exitKind=SIM_EXIT_NONE;
+  sim->published=false;
+  sim->reported=false;
+  sim->wakeStartUs=sim->nowUs;
+  if (sim->lastWakeUs!=0)
+    {
+    double seconds=(sim->nowUs-sim->lastWakeUs)/1e6;
+    sim->stats.intervals++;
+    sim->stats.intervalUs+=sim->nowUs-sim->lastWakeUs;
+    sim->stats.intervalSquares+=seconds*seconds;
+    }
+  sim->lastWakeUs=0;
+  sim->apUp=simRandomUnit()*100<sim->model.apUpPct;
+  if (sim->running && sim->stats.wakes>=sim->model.outageStart && sim->stats.wakes<sim->model.outageStart+sim->model.outageWakes)
+    sim->apUp=false;
+  sim->brokerUp=simRandomUnit()*100<sim->model.brokerUpPct;
+  if (simRandomUnit()*100<sim->model.sessionLossPct) // the broker restarted while we slept
+    {
+    SimSession* session=simSession(sim->clientId,false);
+    if (session!=NULL)
+      session->subscriptionCount=0;
+    sim->inboxCount=0;
+    }
+  sim->stats.wakes++;
+  sim->serialInLineEnd=sim->serialInPos;
+  simTypeLine();
+  if (sim->rfMode==RF_DISABLED)
+    sim->stats.rfDisabledWakes++;
+  fflush(stdout);
+
+  pid_t pid=fork();
+  if (pid<0)
+    {
+    perror("fork");
+    return false;
+    }
+  if (pid==0)
+    {
+    simSetPhase(sim->rfMode==RF_DISABLED ? SIM_PHASE_CPU : SIM_PHASE_BOOT);
+    simAdvanceUs((uint64_t)sim->model.bootMs*1000);
+    simSetPhase(SIM_PHASE_CPU);
+    setup();
+    for (;;)
+      {
+      loop();
+      simAdvanceUs(100); // the core's housekeeping between loop() calls
+      }
+    }
+
+  int status;
+  waitpid(pid,&status,0);
+  if (!WIFEXITED(status) || sim->exitKind==SIM_EXIT_NONE)
+    {
+    fprintf(stderr,"Firmware crashed on wake %llu\n",(unsigned long long)sim->stats.wakes);
+    return false;
+    }
+  if (sim->published)
+    sim->stats.reportWakes++;
+
+  // Sleeping or restarting drops the connection
+  SimSession* session=simSession(sim->clientId,false);
+  if (session!=NULL && session->device==sim->device && session->connectedUntilUs>sim->nowUs)
+    session->connectedUntilUs=sim->nowUs;
+
+  switch (sim->exitKind)
+    {
+    case SIM_EXIT_SLEEP:
+      if (sim->sleepUs>=10000000)
+        sim->lastWakeUs=sim->wakeStartUs;
+      simSetPhase(SIM_PHASE_SLEEP);
+      simAdvanceUs((uint64_t)(sim->sleepUs*(1+sim->model.rtcDriftPct/100)));
+      sim->resetReason=REASON_DEEP_SLEEP_AWAKE;
+      sim->rfMode=sim->nextRfMode;
+      break;
+    case SIM_EXIT_RESTART:
+      sim->stats.restarts++;
+      sim->resetReason=REASON_SOFT_RESTART;
+      sim->rfMode=RF_DEFAULT;
+      break;
+    default:
+      sim->stats.timeouts++;
+      sim->resetReason=REASON_EXT_SYS_RST;
+      sim->rfMode=RF_DEFAULT;
+      break;
+    }
+  return true;
+  }
+
+/*
+ * elapsedUs is how long each device ran, on average.
+ */
+static void report(const char* title, const SimStats* s, uint64_t elapsedUs)
+  {
+  double total_mAs=0;
+  for (int i=0; i<SIM_PHASE_COUNT; i++)
+    total_mAs+=s->phase_mAs[i];
+  double total_mAh=total_mAs/3600.0;
+  double hours=elapsedUs/3.6e9;
+
+  printf("\n%s\n",title);
+  printf("  wakes                %llu (%llu restarts, %llu timeouts, %llu with radio off)\n",
+    (unsigned long long)s->wakes,(unsigned long long)s->restarts,(unsigned long long)s->timeouts,(unsigned long long)s->rfDisabledWakes);
+  printf("  simulated time       %.2f hours\n",hours);
+  printf("  awake per wake       %.1f ms\n",s->wakes ? s->awakeUs/1000.0/s->wakes : 0);
+  printf("  boot to publish      %.1f ms\n",s->reportWakes ? s->toPublishUs/1000.0/s->reportWakes : 0);
+  printf("  reports              %llu wakes published %llu messages, %llu bytes (%llu failed)\n",
+    (unsigned long long)s->reportWakes,(unsigned long long)s->publishes,(unsigned long long)s->publishBytes,(unsigned long long)s->failedPublishes);
+  printf("  wifi                 %llu full, %llu fast, %llu failed\n",
+    (unsigned long long)s->wifiFull,(unsigned long long)s->wifiFast,(unsigned long long)s->wifiFailures);
+  printf("  mqtt                 %llu connects, %llu failed, %llu subscribes\n",
+    (unsigned long long)s->mqttConnects,(unsigned long long)s->mqttFailures,(unsigned long long)s->subscribes);
+  printf("  eeprom commits       %llu\n",(unsigned long long)s->eepromCommits);
+  printf("  file system          %llu mounts, %llu blocks rewritten for %llu bytes\n",
+    (unsigned long long)s->fsMounts,(unsigned long long)s->fsBlockWrites,(unsigned long long)s->fsBytesWritten);
+  printf("  console bytes        %llu\n",(unsigned long long)s->serialBytes);
+  printf("  time syncs           %llu\n",(unsigned long long)s->timeSyncs);
+  if (s->intervals>0)
+    {
+    double mean=s->intervalUs/1e6/s->intervals;
+    printf("  wake interval        %.2f s average, %.2f s deviation\n",mean,sqrt(max(s->intervalSquares/s->intervals-mean*mean,0.0)));
+    }
+  printf("  charge               %.4f mAh total\n",total_mAh);
+  printf("  per wake             %.5f mAh\n",s->wakes ? total_mAh/s->wakes : 0);
+  printf("  per report           %.5f mAh\n",s->reportWakes ? total_mAh/s->reportWakes : 0);
+  for (int i=0; i<SIM_PHASE_COUNT; i++)
+    {
+    printf("    %-10s %12.1f s %10.4f mAh %5.1f%%\n",phaseNames[i],s->phaseUs[i]/1e6,s->phase_mAs[i]/3600.0,
+      total_mAs>0 ? 100*s->phase_mAs[i]/total_mAs : 0);
+    }
+  if (hours>0 && total_mAh>0)
+    {
+    double days=sim->model.capacity_mAh/(total_mAh/fleetSize/hours)/24;
+    printf("  projected life       %.1f days on %.0f mAh\n",days,sim->model.capacity_mAh);
+    }
+  }
+
+static void reportBroker(uint64_t elapsedUs)
+  {
+  simBrokerFlush();
+  printf("\nBroker\n");
+  printf("  devices              %d, using %d client IDs\n",fleetSize,simBroker->sessionCount);
+  printf("  associations         at most %u in one second\n",simBroker->peakAssociations);
+  printf("  connects             %llu, at most %u in one second\n",
+    (unsigned long long)simBroker->connects,simBroker->peakConnects);
+  printf("  messages             %llu, at most %u in one second, %.2f a second on average\n",
+    (unsigned long long)simBroker->messages,simBroker->peakMessages,elapsedUs ? simBroker->messages*1e6/elapsedUs : 0);
+  printf("  busy seconds         %llu\n",(unsigned long long)simBroker->busySeconds);
+  printf("  evictions            %llu\n",(unsigned long long)simBroker->evictions);
+  printf("  report latency       %.1f ms average, %.1f ms worst\n",
+    simBroker->latencyCount ? simBroker->latencySumUs/1000.0/simBroker->latencyCount : 0,simBroker->latencyMaxUs/1000.0);
+  }
+
+/*
+ * Statistics for the whole fleet, and how long each device has run since startUs,
+ * on average.
+ */
+static uint64_t fleetTotals(SimStats* total, const std::vector<uint64_t>& startUs)
+  {
+  static_assert(offsetof(SimStats,phase_mAs)%sizeof(uint64_t)==0,"SimStats counters are not all uint64_t");
+  uint64_t elapsedUs=0;
+  memset(total,0,sizeof(*total));
+  for (int d=0; d<fleetSize; d++)
+    {
+    const uint64_t* from=(const uint64_t*)&fleet[d].stats;
+    uint64_t* to=(uint64_t*)total;
+    for (size_t i=0; i<offsetof(SimStats,phase_mAs)/sizeof(uint64_t); i++)
+      to[i]+=from[i];
+    for (int i=0; i<SIM_PHASE_COUNT; i++)
+      total->phase_mAs[i]+=fleet[d].stats.phase_mAs[i];
+    total->intervalSquares+=fleet[d].stats.intervalSquares;
+    elapsedUs+=fleet[d].nowUs-startUs[d];
+    }
+  return elapsedUs/fleetSize;
+  }
+
+static int removeEntry(const char* path, const struct stat*, int, struct FTW*)
+  {
+  return remove(path);
+  }
+
+/*
+ * Run the simulation. The file system lives in a scratch directory that is removed
+ * at the end.
+ */
+static int run(unsigned long cycles);
+
+int main(int argc, char** argv)
+  {
+  static SimShared given; //filled in from the command line, then copied to each device
+  sim=&given;
+  defaults(&sim->model);
+  sim->chipId=0x00c0ffee;
+  unsigned long cycles=1000;
+  double spreadSeconds=0;
+  double slotPeriod=0;
+  std::string console;
+
+  static struct option options[]=
+    {
+    {"cycles",required_argument,0,'n'},
+    {"set",required_argument,0,'s'},
+    {"capacity",required_argument,0,'c'},
+    {"sleep-ua",required_argument,0,1},
+    {"light-ma",required_argument,0,19},
+    {"boot-ma",required_argument,0,2},
+    {"cpu-ma",required_argument,0,3},
+    {"assoc-ma",required_argument,0,4},
+    {"connected-ma",required_argument,0,5},
+    {"tx-ma",required_argument,0,6},
+    {"boot-ms",required_argument,0,7},
+    {"scan-ms",required_argument,0,8},
+    {"fast-ms",required_argument,0,9},
+    {"dhcp-ms",required_argument,0,10},
+    {"rtt-ms",required_argument,0,11},
+    {"ap-up",required_argument,0,12},
+    {"broker-up",required_argument,0,13},
+    {"max-awake",required_argument,0,14},
+    {"outage",required_argument,0,17},
+    {"session-loss",required_argument,0,18},
+    {"fleet",required_argument,0,20},
+    {"spread",required_argument,0,21},
+    {"broker-rate",required_argument,0,22},
+    {"broker-slots",required_argument,0,23},
+    {"ap-contention",required_argument,0,24},
+    {"rtc-drift",required_argument,0,25},
+    {"chip-id",required_argument,0,15},
+    {"seed",required_argument,0,16},
+    {"verbose",no_argument,0,'v'},
+    {"help",no_argument,0,'h'},
+    {0,0,0,0}
+    };
+  int opt;
+  while ((opt=getopt_long(argc,argv,"n:s:c:vh",options,NULL))!=-1)
+    {
+    switch (opt)
+      {
+      case 'n': cycles=strtoul(optarg,NULL,0); break;
+      case 's': console+=optarg; console+="\n"; break;
+      case 'c': sim->model.capacity_mAh=atof(optarg); break;
+      case 1: sim->model.current_mA[SIM_PHASE_SLEEP]=atof(optarg)/1000.0; break;
+      case 2: sim->model.current_mA[SIM_PHASE_BOOT]=atof(optarg); break;
+      case 3: sim->model.current_mA[SIM_PHASE_CPU]=atof(optarg); break;
+      case 4: sim->model.current_mA[SIM_PHASE_ASSOC]=atof(optarg); break;
+      case 5: sim->model.current_mA[SIM_PHASE_CONNECTED]=atof(optarg); break;
+      case 6: sim->model.current_mA[SIM_PHASE_TX]=atof(optarg); break;
+      case 7: sim->model.bootMs=strtoul(optarg,NULL,0); break;
+      case 8: sim->model.scanMs=strtoul(optarg,NULL,0); break;
+      case 9: sim->model.fastAssocMs=strtoul(optarg,NULL,0); break;
+      case 10: sim->model.dhcpMs=strtoul(optarg,NULL,0); break;
+      case 11: sim->model.rttMs=strtoul(optarg,NULL,0); break;
+      case 12: sim->model.apUpPct=atof(optarg); break;
+      case 13: sim->model.brokerUpPct=atof(optarg); break;
+      case 14: sim->model.maxAwakeMs=strtoul(optarg,NULL,0); break;
+      case 15: sim->chipId=strtoul(optarg,NULL,0); break;
+      case 16: sim->model.seed=strtoul(optarg,NULL,0); break;
+      case 17: sscanf(optarg,"%llu,%llu",(unsigned long long*)&sim->model.outageStart,(unsigned long long*)&sim->model.outageWakes); break;
+      case 18: sim->model.sessionLossPct=atof(optarg); break;
+      case 19: sim->model.current_mA[SIM_PHASE_LIGHT]=atof(optarg); break;
+      case 20: fleetSize=atoi(optarg); break;
+      case 21: spreadSeconds=atof(optarg); break;
+      case 22: sim->model.brokerRate=strtoul(optarg,NULL,0); break;
+      case 23: slotPeriod=atof(optarg); break;
+      case 24: sim->model.apContentionMs=strtoul(optarg,NULL,0); break;
+      case 25: sim->model.rtcDriftPct=atof(optarg); break;
+      case 'v': sim->model.verbose=1; break;
+      default: usage(); return opt=='h' ? 0 : 1;
+      }
+    }
+
+  if (fleetSize<1 || fleetSize>SIM_FLEET_MAX)
+    {
+    fprintf(stderr,"The fleet can have 1 to %d devices\n",SIM_FLEET_MAX);
+    return 1;
+    }
+  fleet=(SimShared*)mmap(NULL,fleetSize*sizeof(SimShared),PROT_READ|PROT_WRITE,MAP_SHARED|MAP_ANONYMOUS,-1,0);
+  simBroker=(SimBroker*)mmap(NULL,sizeof(SimBroker),PROT_READ|PROT_WRITE,MAP_SHARED|MAP_ANONYMOUS,-1,0);
+  if (fleet==MAP_FAILED || simBroker==MAP_FAILED)
+    {
+    perror("mmap");
+    return 1;
+    }
+  memset(simBroker,0,sizeof(*simBroker));
+  given.model.slotStepMs=(uint32_t)(slotPeriod*1000/fleetSize);
+
+  int result=0;
+  for (int d=0; d<fleetSize && result==0; d++)
+    {
+    sim=&fleet[d];
+    memcpy(sim,&given,sizeof(*sim));
+    sim->device=d;
+    sim->chipId=given.chipId+d;
+
+    // A minimal working configuration unless the caller gave one. Each device of a
+    // fleet reports under its own topic.
+    std::string input=console;
+    if (input.empty())
+      {
+      input="ssid=simnet\nwifipass=simpass\nbroker=10.0.0.2\nsleepTime=600\nmqttTopic=sim/battery/";
+      input+=fleetSize>1 ? std::to_string(d)+"/\n" : "\n";
+      }
+    if (input.size()>=sizeof(sim->serialIn))
+      {
+      fprintf(stderr,"Too much console input\n");
+      return 1;
+      }
+    memcpy(sim->serialIn,input.c_str(),input.size());
+    sim->serialInLen=input.size();
+
+    // Power-on state: erased flash, random RTC memory
+    sim->rng=(sim->model.seed ? sim->model.seed : 1)+d*7919;
+    memset(sim->eeprom,0xff,sizeof(sim->eeprom));
+    for (size_t i=0; i<sizeof(sim->rtcMem); i++)
+      sim->rtcMem[i]=simRandom() & 0xff;
+    sim->resetReason=REASON_DEFAULT_RST;
+    sim->rfMode=RF_DEFAULT;
+    sim->nowUs=(uint64_t)(simRandomUnit()*spreadSeconds*1e6);
+
+    strcpy(sim->fsDir,"/tmp/batterysim.XXXXXX");
+    if (!mkdtemp(sim->fsDir))
+      {
+      perror("mkdtemp");
+      sim->fsDir[0]='\0';
+      result=1;
+      }
+    }
+  if (result==0)
+    result=run(cycles);
+  for (int d=0; d<fleetSize; d++)
+    {
+    if (fleet[d].fsDir[0]!='\0')
+      nftw(fleet[d].fsDir,removeEntry,8,FTW_DEPTH|FTW_PHYS);
+    }
+  return result;
+  }
+
+static int run(unsigned long cycles)
+  {
+  // Provisioning: each device keeps waking until its console input has been used and it sleeps
+  std::vector<uint64_t> startUs(fleetSize);
+  for (int d=0; d<fleetSize; d++)
+    {
+    sim=&fleet[d];
+    startUs[d]=sim->nowUs;
+    unsigned long provisioningWakes=0;
+    do
+      {
+      if (!runWake())
+        return 2;
+      if (++provisioningWakes>200)
+        {
+        fprintf(stderr,"Device never went to sleep during provisioning\n");
+        return 2;
+        }
+      } while (sim->serialInPos<sim->serialInLen || sim->exitKind!=SIM_EXIT_SLEEP);
+    }
+  SimStats total;
+  report("Provisioning",&total,fleetTotals(&total,startUs));
+
+  // Fresh batteries and broker counts for the run, but the broker keeps its sessions
+  for (int d=0; d<fleetSize; d++)
+    {
+    memset(&fleet[d].stats,0,sizeof(fleet[d].stats));
+    fleet[d].batteryUsed_mAs=0;
+    fleet[d].running=true;
+    startUs[d]=fleet[d].nowUs;
+    }
+  memset((uint8_t*)simBroker+offsetof(SimBroker,window),0,sizeof(SimBroker)-offsetof(SimBroker,window));
+
+  // Whichever device wakes next goes next
+  for (unsigned long i=0; i<cycles*fleetSize; i++)
+    {
+    sim=&fleet[0];
+    for (int d=1; d<fleetSize; d++)
+      {
+      if (fleet[d].nowUs<sim->nowUs)
+        sim=&fleet[d];
+      }
+    if (!runWake())
+      return 2;
+    }
+  uint64_t elapsedUs=fleetTotals(&total,startUs);
+  report("Run",&total,elapsedUs);
+  if (fleetSize==1)
+    printf("  battery at end       %.3f V\n",simBatteryVolts());
+  else
+    reportBroker(elapsedUs);
+  return 0;
+  }
@@ -10,6 +10,8 @@
 #include <ESP8266WiFi.h>
 #include <EEPROM.h>
 #include <ArduinoOTA.h>
+#include <LittleFS.h>
+#include <sntp.h>
 #include <math.h>
 #include "batteryTest.h"
 
@@ -17,6 +19,7 @@ WiFiClient wifiClient;
 PubSubClient mqttClient(wifiClient);
 
 boolean stayAwake=false;
+boolean consoleOn=false; //the console has been started for output
 
 // These are the settings that get stored in EEPROM.  They are all in one struct which
 // makes it easier to store and retrieve.
@@ -35,15 +38,245 @@ typedef struct
   bool debug=false;
   char address[ADDRESS_SIZE]=""; //static address for this device
   char netmask[ADDRESS_SIZE]=""; //size of network
+  int batchSize=1; //number of readings to collect with the radio off before sending them all
+  int sampleCount=SAMPLE_COUNT; //number of ADC samples that are filtered into one reading
+  int deadband=0; //raw counts the reading must change by to be reported. Zero reports every reading.
+  int heartbeat=DEFAULT_HEARTBEAT; //minutes between reports when the reading isn't changing
+  bool adaptive=false; //sleep longer while the battery voltage is stable
+  int reportFormat=REPORT_FORMAT_CSV; //how the reading is published, one of the REPORT_FORMAT values
+  int wakeSlot=-1; //seconds into the sleep period to wake, or -1 to pick from the chip ID
+  char timeServer[ADDRESS_SIZE]=DEFAULT_TIME_SERVER; //NTP server that keeps the wake grid on time
+  int radioBudget=RADIO_DAILY_BUDGET; //seconds a day the radio may be on, zero for no limit
+  int diagnostics=DEFAULT_DIAGNOSTICS; //reports between diagnostic messages in the packed formats, zero for none
+  uint8_t calCount=0; //points in the calibration table. With none, FULL_BATTERY reads as FULL_VOLTAGE.
+  uint16_t calRaw[CAL_POINTS]={0}; //raw readings, ascending
+  uint16_t calMillivolts[CAL_POINTS]={0}; //and the battery voltage measured at each
   } conf;
 
 conf settings; //all settings in one struct makes it easier to store in EEPROM
 boolean settingsAreValid=false;
 
-String commandString = "";     // a String to hold incoming commands from serial
+// FNV-1a, so names can be hashed at compile time and at run time the same way
+constexpr uint32_t settingHash(const char* name)
+  {
+  uint32_t hash=2166136261u;
+  while (*name)
+    hash=(hash^(uint8_t)*name++)*16777619u;
+  return hash;
+  }
+
+#define TEXT_SETTING(name,field,initial,flags,help) \
+  {name,settingHash(name),offsetof(conf,field),SETTING_TEXT,sizeof(conf::field),0,0,0,initial,flags,help,NULL}
+#define INT_SETTING(name,field,minimum,maximum,initial,flags,help) \
+  {name,settingHash(name),offsetof(conf,field),SETTING_INT,sizeof(int),minimum,maximum,initial,"",flags,help,NULL}
+#define BOOL_SETTING(name,field,initial,flags,help) \
+  {name,settingHash(name),offsetof(conf,field),SETTING_BOOL,sizeof(bool),0,1,initial,"",flags,help,NULL}
+#define CHOICE_SETTING(name,field,choices,initial,flags,help) \
+  {name,settingHash(name),offsetof(conf,field),SETTING_CHOICE,sizeof(int),0,sizeof(choices)/sizeof(choices[0])-1,initial,"",flags,help,choices}
+
+constexpr const char* reportFormatNames[]={"legacy","csv","binary"}; //indexed by REPORT_FORMAT value
+
+// Everything about each setting is described once, here. Commands, the settings
+// display, the settings JSON and the validity check all work from this table.
+constexpr settingDescriptor settingTable[]=
+  {
+  TEXT_SETTING("ssid",ssid,"",SETTING_RESTART|SETTING_REQUIRED,"<wifi ssid>"),
+  TEXT_SETTING("wifipass",wifiPassword,"",SETTING_RESTART|SETTING_REQUIRED,"<wifi password>"),
+  TEXT_SETTING("broker",mqttBrokerAddress,"",SETTING_RESTART|SETTING_REQUIRED,"<MQTT broker host name or address>"),
+  INT_SETTING("port",mqttBrokerPort,1,65535,1883,SETTING_RESTART|SETTING_REQUIRED,"<port number>"),
+  TEXT_SETTING("user",mqttUsername,"",SETTING_RESTART,"<mqtt user>"),
+  TEXT_SETTING("pass",mqttPassword,"",SETTING_RESTART,"<mqtt password>"),
+  TEXT_SETTING("mqttTopic",mqttTopic,"",SETTING_RESTART|SETTING_REQUIRED,"<topic root, must end with \"/\">"),
+  INT_SETTING("sleepTime",sleepTime,0,0x7fffffff,10,0,"<seconds to sleep between measurements>"),
+  INT_SETTING("batchSize",batchSize,1,MAX_BATCH_SIZE,1,SETTING_CLAMP,"<readings to take with the radio off before sending them all>"),
+  INT_SETTING("samples",sampleCount,1,MAX_SAMPLE_COUNT,SAMPLE_COUNT,SETTING_CLAMP,"<ADC samples filtered into each reading>"),
+  INT_SETTING("deadband",deadband,0,0xffff,0,SETTING_CLAMP,"<raw count change needed to report, 0 to report every reading>"),
+  INT_SETTING("heartbeat",heartbeat,1,0x7fffffff,DEFAULT_HEARTBEAT,0,"<minutes between reports when nothing changes>"),
+  BOOL_SETTING("adaptive",adaptive,false,0,"1|0 <sleep longer while the voltage is stable>"),
+  CHOICE_SETTING("format",reportFormat,reportFormatNames,REPORT_FORMAT_CSV,0,"csv|binary|legacy <one report message, or one per value>"),
+  INT_SETTING("slot",wakeSlot,-1,0x7fffffff,-1,0,"<seconds into the sleep period to wake, -1 to pick one from the chip ID>"),
+  TEXT_SETTING("timeServer",timeServer,DEFAULT_TIME_SERVER,0,"<NTP server to keep wakes on a steady grid, NULL for none>"),
+  INT_SETTING("diagnostics",diagnostics,0,0xffff,DEFAULT_DIAGNOSTICS,SETTING_CLAMP,"<send telemetry, life, variance and the like with every Nth report, 0 for never>"),
+  INT_SETTING("radioBudget",radioBudget,0,86400,RADIO_DAILY_BUDGET,SETTING_CLAMP,"<seconds a day the radio may be on, 0 for no limit>"),
+  TEXT_SETTING("address",address,"",SETTING_RESTART,"<Static IP address if so desired>"),
+  TEXT_SETTING("netmask",netmask,"255.255.255.0",SETTING_RESTART,"<Network mask to be used with static IP>"),
+  BOOL_SETTING("debug",debug,false,0,"1|0"),
+  TEXT_SETTING("mqttClientId",mqttClientId,"",SETTING_READONLY|SETTING_REQUIRED,""),
+  };
+constexpr size_t SETTING_COUNT=sizeof(settingTable)/sizeof(settingTable[0]);
+
+// Open addressing on the name hash, built by the compiler
+typedef struct
+  {
+  int8_t slot[SETTING_BUCKETS]; //index into settingTable, -1 if empty
+  } settingIndex;
+
+constexpr settingIndex buildSettingIndex()
+  {
+  settingIndex index{};
+  for (int i=0; i<SETTING_BUCKETS; i++)
+    index.slot[i]=-1;
+  for (size_t i=0; i<SETTING_COUNT; i++)
+    {
+    uint32_t bucket=settingTable[i].hash%SETTING_BUCKETS;
+    while (index.slot[bucket]!=-1)
+      bucket=(bucket+1)%SETTING_BUCKETS;
+    index.slot[bucket]=i;
+    }
+  return index;
+  }
+
+constexpr bool settingHashesUnique()
+  {
+  for (size_t i=0; i<SETTING_COUNT; i++)
+    for (size_t j=i+1; j<SETTING_COUNT; j++)
+      if (settingTable[i].hash==settingTable[j].hash)
+        return false;
+  return true;
+  }
+
+constexpr settingIndex settingLookup=buildSettingIndex();
+static_assert(SETTING_COUNT*2<=SETTING_BUCKETS,"Too many settings for SETTING_BUCKETS");
+static_assert(settingHashesUnique(),"Two setting names have the same hash");
+
+// These are the values that are kept in RTC memory across deep sleeps. They are lost
+// on power down, so they are protected by a CRC to know if they can be trusted.
+typedef struct
+  {
+  uint32_t crc=0; //CRC32 of everything after this field
+  unsigned int validRTC=0;
+  uint8_t bssid[6]={0,0,0,0,0,0}; //the access point we connected to last time
+  uint8_t channel=0; //and its channel. Zero means no cached connection.
+  uint32_t localIP=0; //the address DHCP gave us last time
+  uint32_t gateway=0;
+  uint32_t netmask=0;
+  uint32_t dns=0;
+  uint16_t fastConnects=0; //number of times the cached values got us connected
+  uint16_t slowConnects=0; //number of times we had to do a full scan
+  uint16_t confirmLatency=0; //milliseconds from the last publish to the confirmation, last time
+  uint16_t confirmTimeouts=0; //number of times we gave up waiting for the confirmation
+  uint16_t lastWakeTimes[PHASE_COUNT]={0}; //milliseconds spent in each phase of the last wake with the radio on
+  uint64_t elapsedMs=0; //time since the RTC memory was initialized, awake and asleep
+  uint32_t historySum=0; //sum of the readings going into the next history point
+  uint16_t historyCount=0; //and how many there are
+  uint16_t historyStart=0; //minute (wrapping) of the first of those readings
+  uint8_t historyHead=0; //index of the oldest point in the history
+  uint8_t historyLength=0; //number of points in the history
+  uint16_t historyReading[HISTORY_SIZE]; //average reading for each interval, oldest first
+  uint16_t historyTime[HISTORY_SIZE]; //and the minute (wrapping) it represents
+  bool reportDue=false; //a radio-off wake found something to report, so this wake has to send it
+  uint16_t lastReported=0; //the last reading that was published
+  uint32_t lastReportMinute=0; //and when
+  bool radioOff=false; //we went to sleep with WAKE_RF_DISABLED, so the radio can't be used this time
+  uint8_t batchHead=0; //index of the oldest reading in the batch
+  uint8_t batchCount=0; //number of readings waiting to be sent
+  uint16_t batch[MAX_BATCH_SIZE]; //raw readings taken since the last uplink, oldest first
+  uint16_t batchTime[MAX_BATCH_SIZE]; //and the minute (wrapping) each was taken
+  uint32_t logHead=0; //sequence number of the oldest reading in the flash log not yet delivered
+  uint32_t logTail=0; //sequence number the next reading written to the flash log will get
+  uint32_t reportSeq=0; //number of reports sent, so the receiver can spot missing ones
+  uint32_t session=0; //sessionKey() of the broker session holding our subscription, zero if none
+  uint32_t rtcAtSleep=0; //RTC clock count when we went to sleep
+  uint32_t sleepRequestedMs=0; //how long we asked to sleep, zero once the real time has been measured
+  uint64_t syncWallMs=0; //time from the time server at the last sync, Unix milliseconds. Zero if never.
+  uint64_t syncLocalMs=0; //and elapsedMs at that moment
+  uint64_t syncTriedMs=0; //elapsedMs at the last try, whether or not the time server answered. Zero if never.
+  int32_t driftPpm=0; //how much faster real time runs than elapsedMs, parts per million
+  bool driftKnown=false; //driftPpm has been measured
+  bool consoleWanted=false; //something was typed on the console, so start it on every wake until power is cycled
+  uint16_t lastToPublish=0; //milliseconds from boot to the first report being sent, last wake with the radio on
+  uint16_t lastOverlap=0; //milliseconds of work done while associating, last wake with the radio on
+  uint32_t brokerIP=0; //the broker's address as looked up, zero if it has to be looked up again
+  uint32_t brokerName=0; //CRC32 of the broker setting it was looked up for
+  uint32_t brokerLookupMinute=0; //elapsed minutes when it was looked up
+  uint16_t failStreak=0; //reports in a row that didn't get out
+  uint16_t backoffWakes=0; //wakes left to take with the radio off before trying again
+  uint16_t skippedWakes=0; //wakes the radio was rested since the last report got out
+  uint32_t outageRadioMs=0; //radio-on time spent on failed reports since then
+  uint16_t radioDay=0; //elapsed days when radioMsToday started counting
+  uint32_t radioMsToday=0; //radio-on time that day
+  } rtcConf;
+
+rtcConf rtc; //all RTC values in one struct so they can be checked with one CRC
+boolean rtcIsValid=false;
+static_assert(sizeof(rtcConf)<=RTC_DATA_MAX_SIZE,"RTC data won't fit in RTC user memory");
+
+// One reading in the flash log. The log is a series of segment files named for their
+// segment number, so a record's place in the log follows from its sequence number alone.
+typedef struct
+  {
+  uint32_t seq; //sequence number, never reused
+  uint32_t minute; //elapsed minutes (rtc.elapsedMs) when the reading was taken
+  uint16_t raw; //the reading
+  uint16_t spare;
+  } logRecord;
+
+// The binary report. Little-endian, no padding.
+typedef struct __attribute__((packed))
+  {
+  uint8_t version; //REPORT_PACKET_VERSION
+  uint8_t resetReason; //why we woke up, from the SDK's rst_info
+  uint16_t raw; //the reading
+  uint16_t millivolts; //and what it works out to
+  int8_t rssi; //signal strength, dBm
+  uint32_t seq; //report sequence number
+  int32_t hoursLeft; //battery life estimate, -1 if not known
+  int32_t ratePerDay; //discharge rate, hundredths of a raw count per day, 0 if not known
+  uint32_t variance; //of the samples that went into the reading, counts squared
+  } reportPacket;
+
+// The trace ring sits in the RTC memory below rtcConf. Each event is written there as it
+// happens, so the trace survives a crash or a watchdog reset.
+typedef struct
+  {
+  uint16_t valid; //VALID_TRACE_FLAG
+  uint8_t head; //where the next entry goes
+  uint8_t count; //entries in use
+  uint32_t wake; //wakes since the ring was started
+  } traceHeader;
+
+typedef struct
+  {
+  uint8_t event; //traceEventId
+  uint8_t wake; //low byte of traceHeader.wake when it happened
+  uint16_t ms; //millis() when it happened, at most 65535
+  int32_t value; //depends on the event
+  } traceEntry;
+
+traceHeader trace={0,0,0,0};
+static_assert(sizeof(traceHeader)+TRACE_SIZE*sizeof(traceEntry)<=(RTC_DATA_OFFSET-TRACE_OFFSET)*4,"Trace ring runs into the RTC data");
+const char* eventNames[EVENT_COUNT]={"reset","settings","rtcLost","sample","reading","wifiBegin","wifiUp",
+  "wifiCacheMiss","wifiFailed","badAddress","mqttUp","mqttFailed","subscribe","report","publish","publishFailed",
+  "command","confirmed","confirmTimeout","clockSynced","clockFailed","flashLog","restart","sleep","dns","outOfTime","backoff","radioBudget","recovered"};
+
+boolean logMounted=false;
+uint32_t logSentUpTo=0; //the backlog before this was published this wake, waiting for the delivery confirmation
+uint8_t batchSent=0; //readings at the head of the batch published this wake, waiting for it too
+
+char commandLine[COMMAND_SIZE]; // the command being typed on the serial port
+size_t commandLength=0;        // characters in it so far
 bool commandComplete = false;  // goes true when enter is pressed
+bool commandOverflow = false;  // the line was too long for commandLine and is being thrown away
 
 unsigned long doneTimestamp=0; //used to allow publishes to complete before sleeping
+boolean awaitingConfirm=false; //we sent ourself a sleep command and are waiting for it to come back
+boolean deliveryConfirmed=false; //it came back, so everything published before it has been delivered
+
+reportStep step=STEP_IDLE; //where the report under way is
+unsigned long stepStart=0; //millis() when it got there
+unsigned long reportStart=0; //millis() when it began, for WAKE_BUDGET
+uint8_t mqttTries=0; //broker connection attempts made for it
+int reportReading=0; //the reading it carries, kept for next time if it doesn't get out
+int8_t badAddress=-1; //0 if the address setting is bad, 1 if the netmask is, to be said once the report is over
+
+boolean inMqttLoop=false; //incomingMqttHandler() may be running
+boolean restartPending=false; //a command asked for a restart while it was
+
+boolean inTransaction=false; //settings changes are being held for a commit
+boolean transactionRestart=false; //one of them needs a restart
+unsigned long transactionActivity=0; //millis() at the last command, so an abandoned transaction doesn't keep us awake
+char transactionApplied[TRANSACTION_KEYS_SIZE]=""; //keys changed in the transaction
+char transactionRejected[TRANSACTION_KEYS_SIZE]=""; //keys that were unknown or had bad values
 
 //This is true if a package is detected. It will be written to RTC memory 
 // as "wasPresent" just before sleeping
@@ -52,11 +285,30 @@ bool isPresent=false;
 //This is the distance measured on this pass. It will be written to RTC memory just before sleeping
 int distance=0;
 
+unsigned long phaseStart=0; //millis() at the end of the previous phase
+uint16_t wakeTimes[PHASE_COUNT]={0}; //milliseconds spent in each phase of this wake
+uint16_t toPublishMs=0; //millis() when the first report of this wake was sent, zero until then
+uint16_t overlapMs=0; //milliseconds of work done while associating this wake
+const char* phaseNames[PHASE_COUNT]={"boot","serial","settings","measure","wifi","mqtt","publish","sleepWait"};
+
+int lastReading=0; //the most recent filtered battery measurement, in raw A0 counts
+unsigned int lastVariance=0; //variance of the samples that went into it, in counts squared
+
 ADC_MODE(ADC_VCC); //so we can use the ADC to measure the battery voltage
 
 IPAddress ip;
 IPAddress mask;
 
+WiFiEventHandler gotIpHandler; //held so the WiFi event callbacks stay registered
+WiFiEventHandler disconnectedHandler;
+volatile boolean linkUp=false; //we have an IP address. Set by the WiFi event callbacks.
+volatile boolean linkLost=false; //the SDK gave up on an association attempt
+volatile unsigned long linkUpMs=0; //millis() when linkUp was set
+boolean wifiStarted=false; //startWiFi() began an association that hasn't been waited for
+boolean wifiFast=false; //and it used the cached channel and BSSID
+unsigned long wifiStartMs=0; //when it began
+unsigned long radioOnMs=0; //millis() when the radio was first started this wake, zero if it wasn't
+
 void otaSetup()
   {
   // Port defaults to 3232
@@ -110,23 +362,36 @@ void otaSetup()
 
 void setup() 
   {  
+  markPhase(PHASE_BOOT);
   wifi_status_led_uninstall(); //get rid of the blue LED to save power
   pinMode(LED_BLUE,INPUT);    // Still wants to flash on every wakeup
   digitalWrite(LED_BLUE,HIGH);// maybe this will help
 
   //system_update_cpu_freq(80);
 
-  Serial.begin(9600);
-  Serial.setTimeout(10000);
-  Serial.println();
-  
-  while (!Serial); // wait here for serial port to connect.
-  Serial.println("Serial line initialized.");
+  traceBegin();
+  uint32_t resetReason=ESP.getResetInfoPtr()->reason;
+
+  //Every line printed at 9600 baud is awake time, and on a timer wake nobody is
+  //usually watching. So just listen, and start talking when something is typed.
+  boolean quiet=QUIET_BOOT && resetReason==REASON_DEEP_SLEEP_AWAKE;
+  if (quiet)
+    Serial.begin(9600,SERIAL_8N1,SERIAL_RX_ONLY); //output is dropped until startConsole()
+  else
+    startConsole();
+  markPhase(PHASE_SERIAL);
+  if (resetReason!=REASON_DEEP_SLEEP_AWAKE)
+    TRACE_WARN(EVENT_RESET,resetReason,"Reset reason is %u.\n",resetReason);
 
   EEPROM.begin(sizeof(settings)); //fire up the eeprom section of flash
-  commandString.reserve(200); // reserve 200 bytes of serial buffer space for incoming command string
 
   loadSettings(); //set the values from eeprom
+  if (!loadRTC() && settingsAreValid) //get the values we saved before sleeping, if any
+    recoverLog(); //lost track of the flash log, so find it again
+  measureSleep();
+  if (quiet && (!settingsAreValid || !rtcIsValid || rtc.consoleWanted || settings.debug))
+    startConsole(); //something needs attention, or someone is watching
+  markPhase(PHASE_SETTINGS);
   if (settings.mqttBrokerPort < 0) //then this must be the first powerup
     {
     Serial.println("\n*********************** Resetting All EEPROM Values ************************");
@@ -136,40 +401,61 @@ void setup()
     ESP.restart();
     }
 
-  if (settingsAreValid)
+  if (settingsAreValid
+      && rtcIsValid && rtc.radioOff
+      && ESP.getResetInfoPtr()->reason==REASON_DEEP_SLEEP_AWAKE)
     {
-    if (settings.sleepTime==0) //another way to keep it from sleeping
-      stayAwake=true;
-
-    if (!ip.fromString(settings.address))
+    //The radio is off this time, so just take a reading, save it, and go back to sleep.
+    //If it needs to be reported, come right back with the radio on.
+    int raw=measure();
+    if (radioResting())
       {
-      Serial.println("IP Address "+String(settings.address)+" is not valid. Using dynamic addressing.");
-      // settingsAreValid=false;
-      // settings.validConfig=false;
+      keepReading(raw); //it goes out with the first report that gets through
+      rtc.reportDue=false;
+      if (rtc.backoffWakes>0)
+        rtc.backoffWakes--;
+      rtc.skippedWakes++;
       }
-    else if (!mask.fromString(settings.netmask))
+    else
       {
-      Serial.println("Network mask "+String(settings.netmask)+" is not valid.");
-      // settingsAreValid=false;
-      // settings.validConfig=false;
+      if (settings.batchSize>1)
+        addToBatch(raw);
+      rtc.reportDue=reportNeeded(raw);
       }
+    markPhase(PHASE_MEASURE);
+    goToSleep();
+    }
 
-    if (connectToWiFi()) // attempt to connect to Wifi network
-      {
-      otaSetup(); //initialize the OTA stuff
-      reconnect();  // connect to the MQTT broker
-
-      //Get a measurement. 
-      int analog=readBattery();
-      
-      Serial.print("Analog input is ");
-      Serial.println(analog);
+  if (settingsAreValid)
+    {
+    rtc.reportDue=false; //we're going to report now
+    if (settings.sleepTime==0) //another way to keep it from sleeping
+      stayAwake=true;
 
-      Serial.print("Battery voltage: ");
-      Serial.println(convertToVoltage(analog));
+    mqttClient.setServer(settings.mqttBrokerAddress, settings.mqttBrokerPort);
+    mqttClient.setCallback(incomingMqttHandler);
+    mqttClient.setSocketTimeout((MQTT_CONNECT_TIMEOUT+999)/1000); //seconds
+    wifiClient.setTimeout(MQTT_CONNECT_TIMEOUT); //a dead broker costs this, not the default 5 seconds
 
-      send(); //decide whether or not to send a report
-      }
+    if (!ip.fromString(settings.address)) //complaints wait until the report is out
+      badAddress=0;
+    else if (!mask.fromString(settings.netmask))
+      badAddress=1;
+
+    //Get a measurement while the radio is still quiet
+    int analog=measure();
+    markPhase(PHASE_MEASURE);
+
+    //Associating takes a while, so start it and get everything else ready meanwhile
+    startWiFi();
+    unsigned long overlapStart=millis();
+    otaSetup(); //initialize the OTA stuff
+    if (rtc.logTail!=rtc.logHead)
+      mountLog(); //there is a backlog to send
+    unsigned long overlapEnd=millis();
+    overlapMs=(linkUp?min(overlapEnd,(unsigned long)linkUpMs):overlapEnd)-overlapStart;
+
+    beginReport(analog); //loop() takes it from here
     }
   else
     {
@@ -185,103 +471,554 @@ void loop()
   if (settingsAreValid)
     {
     ArduinoOTA.handle(); //Check for new version
-    mqttClient.loop(); //This has to happen every so often or we get disconnected for some reason
+    serviceMqtt(); //This has to happen every so often or we get disconnected for some reason
+    runReport(); //move the report along if it can be
     }
 
   checkForCommand(); // Check for input in case something needs to be changed to work
+  if (inTransaction && millis()-transactionActivity>TRANSACTION_TIMEOUT)
+    abortTransaction(); //nobody is going to commit it
+
+  if (step!=STEP_IDLE)
+    delay(REPORT_POLL); //waiting on the network. The SDK runs while we do.
+  else if (!stayAwake && settingsAreValid && !inTransaction) //the report is out, or given up on
+    goToSleep();
+  else if (millis() > nextReport) 
+    {
+    int analog=measure();
+    if (settingsAreValid)
+      beginReport(analog);
+    nextReport=millis()+max(settings.sleepTime*1000,1000); //one second minimum between reports
+    }
+  else if (stayAwake)
+    idle(nextReport-millis());
+  }
+
+/*
+ * Nothing to do for a while, so nap. With light sleep allowed, delay() lets the SDK
+ * power down the CPU and radio between access point beacons. A command from the
+ * broker or the console waits at most a slice plus a beacon interval, with typed
+ * characters held in the UART FIFO meanwhile.
+ */
+void idle(unsigned long ms)
+  {
+  if (WiFi.getSleepMode()!=WIFI_LIGHT_SLEEP)
+    WiFi.setSleepMode(WIFI_LIGHT_SLEEP,LIGHT_SLEEP_LISTEN_INTERVAL);
+  if (Serial.available()==0)
+    delay(min(ms,(unsigned long)IDLE_SLICE_MS));
+  }
 
-  if (!stayAwake && settingsAreValid           //setup has been done and
-      && millis()-doneTimestamp>PUBLISH_DELAY) //waited long enough for report to finish
+/*
+ * Save what needs saving and go into deep sleep until the next reading.
+ */
+void goToSleep()
+  {
+  if (radioOnMs!=0)
     {
-    Serial.print("Sleeping for ");
-    Serial.print(settings.sleepTime);
-    Serial.println(" seconds");
+    radioBudgetSpent(); //starts a new day's count when it's time
+    rtc.radioMsToday+=millis()-radioOnMs;
+    }
+  RFMode mode=nextWakeMode();
+  uint32_t sleepSeconds=nextSleepTime();
+  uint32_t sleepMs=rtc.reportDue?sleepSeconds*1000:staggeredSleep(sleepSeconds);
+  sleepMs=(int64_t)sleepMs*1000000/(1000000+rtc.driftPpm); //what the RTC clock will count as that long
+  if (mode==WAKE_RF_DISABLED) //these come often, so only when debugging
+    TRACE_DEBUG(EVENT_SLEEP,sleepMs,"Sleeping for %u.%u seconds with the radio off\n",sleepMs/1000,sleepMs%1000/100);
+  else
+    TRACE_INFO(EVENT_SLEEP,sleepMs,"Sleeping for %u.%u seconds\n",sleepMs/1000,sleepMs%1000/100);
 
-    WiFi.disconnect(true);
-    yield();  
-    ESP.deepSleep(settings.sleepTime*1000000, WAKE_RF_DEFAULT); //tried WAKE_RF_DISABLED but can't wake it back up
+  markPhase(PHASE_SLEEP_WAIT);
+  rtc.elapsedMs+=millis()+sleepMs; //measureSleep() puts it right when we wake
+  rtc.sleepRequestedMs=sleepMs;
+  rtc.rtcAtSleep=system_get_rtc_time();
+  if (!rtc.radioOff) //keep the times from the last wake that did something interesting
+    {
+    memcpy(rtc.lastWakeTimes,wakeTimes,sizeof(rtc.lastWakeTimes));
+    rtc.lastToPublish=toPublishMs;
+    rtc.lastOverlap=overlapMs;
     }
-  else if (millis() > nextReport) 
+
+  rtc.radioOff=mode==WAKE_RF_DISABLED;
+  saveRTC(); //keep the connection info and readings for next time
+  WiFi.disconnect(true);
+  yield();
+  ESP.deepSleep((uint64_t)sleepMs*1000, mode);
+  }
+
+/*
+ * Units that powered up together share the start of rtc.elapsedMs, so they would wake
+ * together every period and all hit the access point and broker at once. Instead each
+ * wakes at its own slot in the period, given by the broker with the slot setting or
+ * picked from the chip ID. A little jitter spreads out units that land on the same
+ * chip ID slot. The first sleep after a change is somewhere between half and one and
+ * a half periods; after that they keep to the period. Once the clock has been synced
+ * the periods are counted from the Unix epoch, so the grid is the same for every unit
+ * and stays put in real time.
+ */
+uint32_t staggeredSleep(uint32_t seconds)
+  {
+  uint32_t periodMs=seconds*1000;
+  if (periodMs<STAGGER_MIN_PERIOD)
+    return periodMs;
+  uint32_t slotMs;
+  uint32_t jitterMs=0;
+  if (settings.wakeSlot>=0)
+    slotMs=(uint64_t)settings.wakeSlot*1000%periodMs;
+  else
     {
-    send();
-    nextReport=millis()+max(settings.sleepTime*1000,1000); //one second minimum between reports
+    uint32_t chipId=ESP.getChipId();
+    slotMs=calculateCRC32((const uint8_t*)&chipId,sizeof(chipId))%periodMs; //neighboring IDs land far apart
+    jitterMs=random(min(periodMs/STAGGER_JITTER_DIVISOR,(uint32_t)STAGGER_JITTER_MAX)+1);
     }
+  uint64_t earliest=clockNow()+periodMs/2;
+  uint32_t sleepMs=periodMs/2+(slotMs+periodMs-earliest%periodMs)%periodMs+jitterMs;
+  return min((uint64_t)sleepMs,ESP.deepSleepMax()/1000);
   }
 
-boolean send()
+/*
+ * Real time in milliseconds: Unix time if the clock has been synced, otherwise
+ * elapsedMs.
+ */
+uint64_t clockNow()
   {
-  boolean ok=true;  //in case settings are not valid
-  if (settingsAreValid)
+  uint64_t now=rtc.elapsedMs+millis();
+  if (rtc.syncWallMs==0)
+    return now;
+  int64_t sinceSync=now-rtc.syncLocalMs;
+  return rtc.syncWallMs+sinceSync+sinceSync*rtc.driftPpm/1000000;
+  }
+
+/*
+ * The RTC clock keeps counting through deep sleep, so it can tell how long the sleep
+ * and the boot after it really took, and elapsedMs is corrected to match. The RTC
+ * oscillator drifts with temperature, which only syncClock() can catch.
+ */
+void measureSleep()
+  {
+  if (!rtcIsValid || rtc.sleepRequestedMs==0)
+    return;
+  uint32_t cycles=system_get_rtc_time()-rtc.rtcAtSleep;
+  uint64_t sleptMs=(uint64_t)cycles*system_rtc_clock_cali_proc()/4096/1000; //calibration is microseconds per cycle, Q12
+  rtc.elapsedMs=rtc.elapsedMs-rtc.sleepRequestedMs+sleptMs-millis();
+  rtc.sleepRequestedMs=0;
+  }
+
+/*
+ * Once in a while, get the time from the time server. How far elapsedMs has strayed
+ * from it since the last time gives the oscillator drift, which goToSleep() then
+ * takes out of each sleep. A server that doesn't answer isn't tried again any sooner.
+ */
+void syncClock()
+  {
+  uint64_t now=rtc.elapsedMs+millis();
+  if (strlen(settings.timeServer)==0
+      || (rtc.syncTriedMs!=0 && now-rtc.syncTriedMs<CLOCK_SYNC_INTERVAL))
+    return;
+  rtc.syncTriedMs=now;
+
+  sntp_setservername(0,settings.timeServer);
+  sntp_init();
+  unsigned long start=millis();
+  uint32_t seconds;
+  while ((seconds=sntp_get_current_timestamp())<CLOCK_VALID_TIME && millis()-start<CLOCK_SYNC_TIMEOUT)
+    delay(5);
+  sntp_stop();
+  if (seconds<CLOCK_VALID_TIME)
+    {
+    TRACE_WARN(EVENT_CLOCK_FAILED,0,"************ No answer from the time server!\n");
+    return;
+    }
+
+  uint64_t wallMs=(uint64_t)seconds*1000;
+  now=rtc.elapsedMs+millis();
+  if (rtc.syncWallMs!=0 && now-rtc.syncLocalMs>=CLOCK_SYNC_INTERVAL/2) //long enough to see the drift past the rounding
+    {
+    int64_t local=now-rtc.syncLocalMs;
+    int32_t ppm=((int64_t)(wallMs-rtc.syncWallMs)-local)*1000000/local;
+    rtc.driftPpm=rtc.driftKnown?(rtc.driftPpm+ppm)/2:ppm;
+    rtc.driftKnown=true;
+    }
+  rtc.syncWallMs=wallMs;
+  rtc.syncLocalMs=now;
+  TRACE_INFO(EVENT_CLOCK_SYNCED,rtc.driftPpm,"Clock synced, drift is %d ppm\n",(int)rtc.driftPpm);
+  }
+
+/*
+ * Decide how long to sleep. Normally that's sleepTime, but in adaptive mode it is
+ * stretched to about the time it will take the reading to change by half the deadband,
+ * based on the discharge rate. That's long while the battery is on its plateau and
+ * short as it falls off the knee. Never longer than the heartbeat or the chip allows.
+ */
+uint32_t nextSleepTime()
+  {
+  if (rtc.reportDue)
+    return RADIO_WAKE_SLEEP;
+
+  uint32_t seconds=settings.sleepTime;
+  if (settings.adaptive && rtc.historyLength>=3)
+    {
+    int32_t rate=0;
+    int32_t hours;
+    estimateLife(&rate,&hours);
+    uint32_t step=settings.deadband>0?settings.deadband/2:ADAPTIVE_STEP;
+    uint64_t stretched=(uint64_t)settings.sleepTime*MAX_SLEEP_STRETCH;
+    if (rate<0) //rate is hundredths of a count per day
+      stretched=min(stretched,(uint64_t)step*100*86400/(uint32_t)(-rate));
+    seconds=max((uint64_t)settings.sleepTime,stretched);
+    }
+  if (settings.deadband>0)
+    seconds=min(seconds,(uint32_t)settings.heartbeat*60);
+  return min((uint64_t)seconds,ESP.deepSleepMax()/1000000);
+  }
+
+/*
+ * Should this reading be reported? Always, unless there is a batch or a deadband. A
+ * full batch is always reported. With a deadband, so is a reading that has moved far
+ * enough from the last reported one, or one taken when the heartbeat is due.
+ */
+boolean reportNeeded(int raw)
+  {
+  if (settings.batchSize>1 && rtc.batchCount>=settings.batchSize)
+    return true;
+  if (settings.deadband==0)
+    return settings.batchSize<=1; //with a batch, only it filling up calls for a report
+  if (rtc.lastReported==0)
+    return true;
+  uint32_t now=(rtc.elapsedMs+millis())/60000;
+  return abs(raw-rtc.lastReported)>=settings.deadband
+    || now-rtc.lastReportMinute>=(uint32_t)settings.heartbeat;
+  }
+
+/*
+ * The radio can only be turned on during a wake if the previous deep sleep was entered
+ * with it enabled, so the decision has to be made before sleeping. Wake with the radio
+ * off unless the next reading is the one that fills the batch, or a report is due.
+ */
+RFMode nextWakeMode()
+  {
+  if (radioResting())
+    return WAKE_RF_DISABLED;
+  if (rtc.reportDue)
+    return WAKE_RF_DEFAULT;
+  if (settings.batchSize>1 && rtc.batchCount+1>=settings.batchSize)
+    return WAKE_RF_DEFAULT; //the next reading fills the batch
+  if (settings.batchSize>1 || settings.deadband>0)
+    return WAKE_RF_DISABLED; //if the next reading is worth reporting, it will come right back with the radio on
+  return WAKE_RF_DEFAULT;
+  }
+
+/*
+ * Start getting a report out. Nothing waits for the network here: runReport() does
+ * the work a step at a time as loop() comes around, and gives up when the report has
+ * taken WAKE_BUDGET.
+ */
+void beginReport(int analog)
+  {
+  reportReading=analog;
+  reportStart=millis();
+  mqttTries=0;
+  deliveryConfirmed=false;
+  awaitingConfirm=false;
+  setStep(STEP_WIFI);
+  }
+
+/*
+ * Take the report as far as it can go without waiting.
+ */
+void runReport()
+  {
+  reportStep was=STEP_IDLE;
+  while (step!=STEP_IDLE && step!=was) //on to the next step right away if this one is done
     {
-    if (connectToWiFi())// ********************* attempt to connect to Wifi network
+    was=step;
+    unsigned long now=millis();
+    if (now-reportStart>WAKE_BUDGET && step<STEP_PUBLISH) //once connected, see it through. The confirmation has its own timeout.
+      {
+      TRACE_WARN(EVENT_OUT_OF_TIME,step,"************ Report ran out of time, keeping the reading for next time!\n");
+      abandonReport();
+      return;
+      }
+
+    switch (step)
       {
-      ok=reconnect();  // connect to the MQTT broker  
-      if (ok)
-        report();
+      case STEP_WIFI:
+        {
+        int wifi=checkWiFi();
+        if (wifi<0)
+          abandonReport();
+        else if (wifi>0)
+          {
+          markPhase(PHASE_WIFI);
+          setStep(STEP_MQTT);
+          }
+        break;
+        }
+
+      case STEP_MQTT:
+        if (!mqttClient.connected() && mqttTries<MQTT_RECONNECT_TRIES
+            && (mqttTries==0 || now-stepStart>=MQTT_RETRY_DELAY))
+          {
+          mqttTries++;
+          connectMqtt();
+          stepStart=millis(); //the pause is counted from the end of the try
+          }
+        if (mqttClient.connected())
+          {
+          markPhase(PHASE_MQTT);
+          setStep(STEP_PUBLISH);
+          }
+        else if (mqttTries>=MQTT_RECONNECT_TRIES)
+          abandonReport();
+        break;
+
+      case STEP_PUBLISH:
+        if (!publishReport())
+          abandonReport();
+        else if (awaitingConfirm)
+          setStep(STEP_CONFIRM);
+        else
+          endReport();
+        break;
+
+      case STEP_CONFIRM:
+        if (deliveryConfirmed)
+          endReport();
+        else if (now-doneTimestamp>CONFIRM_TIMEOUT)
+          {
+          rtc.confirmTimeouts++;
+          TRACE_WARN(EVENT_CONFIRM_TIMEOUT,rtc.confirmTimeouts,"Delivery was not confirmed, sleeping anyway.\n");
+          rtc.session=0; //maybe the broker lost our subscription, so make it again next time
+          endReport();
+          }
+        break;
+
+      default:
+        break;
       }
-    else 
-      ok=false;
     }
+  }
+
+void setStep(reportStep next)
+  {
+  step=next;
+  stepStart=millis();
+  }
+
+/*
+ * The report is out, confirmed or not. Now do what would have held it up.
+ */
+void endReport()
+  {
+  setStep(STEP_IDLE);
+  syncClock(); //once in a while
+  complainAboutAddress();
+  }
+
+/*
+ * setup() found the static address settings bad and is using dynamic addressing.
+ * Say so, once.
+ */
+void complainAboutAddress()
+  {
+  if (badAddress==0)
+    {
+    TRACE_WARN(EVENT_BAD_ADDRESS,0,"IP Address %s is not valid. Using dynamic addressing.\n",settings.address);
+    // settingsAreValid=false;
+    // settings.validConfig=false;
+    }
+  else if (badAddress==1)
+    {
+    TRACE_WARN(EVENT_BAD_ADDRESS,1,"Network mask %s is not valid.\n",settings.netmask);
+    // settingsAreValid=false;
+    // settings.validConfig=false;
+    }
+  badAddress=-1;
+  }
+
+/*
+ * Send the report and whatever piled up while we couldn't, then a sleep command to
+ * ourself. The broker handles our messages in order, so when it comes back the report
+ * has surely been delivered and we can go to sleep.
+ */
+boolean publishReport()
+  {
+  if (!report())
+    return false; //the reading is still in the batch
+  if ((rtc.failStreak>0 || rtc.skippedWakes>0) && publishOutage())
+    {
+    rtc.failStreak=0;
+    rtc.skippedWakes=0;
+    rtc.outageRadioMs=0;
+    }
+  drainLog(); //send whatever piled up while we couldn't
+  markPhase(PHASE_PUBLISH);
 
-  /////// idea: change this to send a sleep command to ourself via mqtt. That way the previous
-  /////// report will surely have been delivered by the time we sleep.
+  char topic[MQTT_TOPIC_SIZE];
+  strcpy(topic,settings.mqttTopic);
+  strcat(topic,MQTT_TOPIC_COMMAND_REQUEST);
+  deliveryConfirmed=false;
+  awaitingConfirm=publish(topic,MQTT_PAYLOAD_SLEEP_COMMAND,false);
   doneTimestamp=millis(); //this is to allow the publish to complete before sleeping
-  return ok;
+  return true;
+  }
+
+/*
+ * The report didn't get out. Hang on to the reading until the network is back. If
+ * it failed while publishing, report() has already put the reading in the batch.
+ */
+void abandonReport()
+  {
+  if (step<=STEP_PUBLISH)
+    {
+    if (step<STEP_PUBLISH)
+      keepReading(reportReading);
+    rtc.failStreak++;
+    rtc.outageRadioMs+=millis()-reportStart;
+    backOff();
+    }
+  setStep(STEP_IDLE);
+  complainAboutAddress();
+  }
+
+/*
+ * After BACKOFF_START failed reports in a row, rest the radio for a wake, then two,
+ * four and so on up to about BACKOFF_LIMIT, so an outage doesn't cost a full attempt
+ * every wake. The readings are kept meanwhile.
+ */
+void backOff()
+  {
+  if (rtc.failStreak<BACKOFF_START)
+    return;
+  uint32_t limit=max(BACKOFF_LIMIT/max(settings.sleepTime,1),1);
+  uint32_t wakes=1UL<<min(rtc.failStreak-BACKOFF_START,15);
+  rtc.backoffWakes=min(wakes,limit);
+  TRACE_WARN(EVENT_BACKOFF,rtc.backoffWakes,"%u reports failed in a row, resting the radio for %u wakes.\n",
+    rtc.failStreak,rtc.backoffWakes);
+  }
+
+/*
+ * The radio is being kept off, either backing off from an outage or because it has
+ * been on for settings.radioBudget today.
+ */
+boolean radioResting()
+  {
+  return rtc.backoffWakes>0 || radioBudgetSpent();
+  }
+
+/*
+ * Radio-on time is counted a day at a time. Zero radioBudget means no limit.
+ */
+boolean radioBudgetSpent()
+  {
+  uint16_t today=(rtc.elapsedMs+millis())/(24ULL*ONE_HOUR);
+  if (today!=rtc.radioDay)
+    {
+    rtc.radioDay=today;
+    rtc.radioMsToday=0;
+    }
+  if (settings.radioBudget==0 || rtc.radioMsToday<(uint32_t)settings.radioBudget*1000)
+    return false;
+  TRACE_DEBUG(EVENT_RADIO_BUDGET,rtc.radioMsToday,"Radio has been on %u ms today, keeping it off.\n",rtc.radioMsToday);
+  return true;
   }
 
-  
 /*
- * If not connected to wifi, connect.
+ * Start associating with the access point, and return without waiting for it so
+ * the wake can get on with other things. The cached channel and BSSID are tried
+ * first, skipping the scan and DHCP. checkWiFi() takes it from there.
  */
-boolean connectToWiFi()
+void startWiFi()
   {
-  boolean connected=true; // assume all ok 
-  if (WiFi.status() != WL_CONNECTED)
+  if (!gotIpHandler)
     {
-    Serial.print("Attempting to connect to WPA SSID \"");
-    Serial.print(settings.ssid);
-    Serial.println("\"");
+    gotIpHandler=WiFi.onStationModeGotIP([](const WiFiEventStationModeGotIP&)
+      {
+      linkUp=true;
+      linkUpMs=millis();
+      });
+    disconnectedHandler=WiFi.onStationModeDisconnected([](const WiFiEventStationModeDisconnected&)
+      {
+      linkUp=false;
+      linkLost=true;
+      });
+    }
+  TRACE_DEBUG(EVENT_WIFI_BEGIN,rtcIsValid?rtc.channel:0,"Attempting to connect to WPA SSID \"%s\"\n",settings.ssid);
 
 //    WiFi.forceSleepWake(); //turn on the radio
 //    delay(1);              //return control to let it come on
     
-    WiFi.mode(WIFI_STA); //station mode, we are only a client in the wifi world
+  WiFi.mode(WIFI_STA); //station mode, we are only a client in the wifi world
 
+  linkUp=false;
+  linkLost=false;
+  wifiFast=rtcIsValid && rtc.channel>0;
+  if (wifiFast) //the fast way
+    {
+    if (ip.isSet())
+      WiFi.config(ip,ip,mask);
+    else
+      WiFi.config(IPAddress(rtc.localIP),IPAddress(rtc.gateway),IPAddress(rtc.netmask),IPAddress(rtc.dns));
+    WiFi.begin(settings.ssid, settings.wifiPassword, rtc.channel, rtc.bssid);
+    }
+  else
+    {
     if (ip.isSet()) //Go with a dynamic address if no valid IP has been entered
       {
       if (!WiFi.config(ip,ip,mask))
         {
-        Serial.println("STA Failed to configure");
+        TRACE_ERROR(EVENT_WIFI_FAILED,-1,"STA Failed to configure\n");
         }
       }
     WiFi.begin(settings.ssid, settings.wifiPassword);
-    int8 wifiTries=WIFI_ATTEMPTS;
-    while (WiFi.status() != WL_CONNECTED && wifiTries-- > 0) 
-      {
-      // not yet connected
-      Serial.print(".");
-      checkForCommand(); // Check for input in case something needs to be changed to work
-      delay(500);
-      }
-    connected=wifiTries>0;
-  
-    if (connected)
-      {
-      Serial.print("Connected to network with address ");
-      Serial.println(WiFi.localIP());
-      Serial.println();
-      }
-    else
+    }
+  wifiStarted=true;
+  wifiStartMs=millis();
+  if (radioOnMs==0)
+    radioOnMs=wifiStartMs;
+  }
+
+/*
+ * See how the association started by startWiFi() is going: 1 if the link is up, 0 if
+ * it's still coming, -1 if it failed. The event callbacks say the moment the link is
+ * up, or that the cached access point isn't there, in which case it falls back to a
+ * full scan.
+ */
+int checkWiFi()
+  {
+  if (linkUp)
+    {
+    if (wifiStarted) //it just came up
       {
-      Serial.println("Failed to connect to network.");
+      wifiStarted=false;
+      if (wifiFast)
+        rtc.fastConnects++;
+      else
+        rtc.slowConnects++;
+      cacheWiFi(); //save it for a fast connection next time
+      TRACE_INFO(EVENT_WIFI_UP,millis(),"Connected to network with address %s\n",WiFi.localIP().toString().c_str());
       }
+    return 1;
+    }
+  if (!wifiStarted)
+    startWiFi(); //the link went away while we were staying awake
+
+  unsigned long waited=millis()-wifiStartMs;
+  if (wifiFast && (linkLost || waited>=WIFI_FAST_TIMEOUT))
+    {
+    TRACE_WARN(EVENT_WIFI_CACHE_MISS,rtc.channel,"Cached connection failed, doing a full scan.\n");
+    rtc.channel=0; //don't try it again until we have a good one
+    WiFi.disconnect();
+    WiFi.config(0U,0U,0U); //back to DHCP
+    startWiFi();
     }
-  else if (settings.debug)
+  else if (!wifiFast && waited>=max((unsigned long)WIFI_ATTEMPTS*WIFI_ATTEMPT_MS>>min(rtc.failStreak,(uint16_t)8),
+      (unsigned long)WIFI_MIN_SCAN_MS)) //shorter while the network keeps not being there
     {
-    Serial.print("Actual network address is ");
-    Serial.println(WiFi.localIP());
+    wifiStarted=false;
+    TRACE_ERROR(EVENT_WIFI_FAILED,WiFi.status(),"Failed to connect to network.\n");
+    return -1;
     }
-  return connected;
+  return 0;
   }
 
 /**
@@ -295,129 +1032,119 @@ boolean connectToWiFi()
  */
 void incomingMqttHandler(char* reqTopic, byte* payload, unsigned int length) 
   {
-  if (settings.debug)
-    {
-    Serial.println("====================================> Callback works.");
-    }
-  payload[length]='\0'; //this should have been done in the caller code, shouldn't have to do it here
+  TRACE_DEBUG(EVENT_COMMAND,length,"Command received on %s\n",reqTopic);
   boolean rebootScheduled=false; //so we can reboot after sending the reboot response
-  char charbuf[100];
-  sprintf(charbuf,"%s",payload);
+  char command[MQTT_COMMAND_SIZE]; //our own copy of the payload, so it can be terminated and split up
+  char topic[MQTT_TOPIC_SIZE];
   const char* response;
+  char summary[TRANSACTION_SUMMARY_SIZE];
+
+  if (length>=sizeof(command))
+    {
+    TRACE_WARN(EVENT_COMMAND,length,"************ MQTT command is too long, ignored!\n");
+    if (snprintf(topic,sizeof(topic),"%s%s",settings.mqttTopic,MQTT_TOPIC_ERROR)<(int)sizeof(topic))
+      publish(topic,"command too long",false);
+    return;
+    }
+  memcpy(command,payload,length);
+  command[length]='\0';
+  while (length>0 && (command[length-1]=='\r' || command[length-1]=='\n'))
+    command[--length]='\0'; //a trailing line ending doesn't make it several lines
+  boolean isTransaction=memchr(command,'\n',length)!=NULL; //several settings, one per line
   
-  
+  //our own sleep command came back, so everything sent before it has been delivered
+  if (!isTransaction && strcmp(command,MQTT_PAYLOAD_SLEEP_COMMAND)==0)
+    {
+    if (awaitingConfirm && !deliveryConfirmed)
+      {
+      rtc.confirmLatency=millis()-doneTimestamp;
+      TRACE_DEBUG(EVENT_CONFIRMED,rtc.confirmLatency,"Delivery confirmed in %ums\n",rtc.confirmLatency);
+      }
+    deliveryConfirmed=true;
+    commitLog(); //the backlog that was sent can be let go
+    commitBatch(); //and so can the batch
+    return; //no response to this one
+    }
+
+  //apply all of the settings together, with one EEPROM write and at most one restart
+  if (isTransaction)
+    {
+    beginTransaction();
+    char* next=NULL;
+    for (char* line=strtok_r(command,"\r\n",&next); line!=NULL; line=strtok_r(NULL,"\r\n",&next))
+      {
+      if (strcmp(line,"begin")!=0 && strcmp(line,"commit")!=0)
+        processCommand(line);
+      }
+    rebootScheduled=commitTransaction(summary);
+    response=summary;
+    strcpy(command,"commit"); //the response topic
+    }
   //if the command is MQTT_PAYLOAD_SETTINGS_COMMAND, send all of the settings
-  if (strcmp(charbuf,MQTT_PAYLOAD_SETTINGS_COMMAND)==0)
+  else if (strcmp(command,MQTT_PAYLOAD_SETTINGS_COMMAND)==0)
     {
-    char tempbuf[35]; //for converting numbers to strings
-    char jsonStatus[JSON_STATUS_SIZE];
-    
-    strcpy(jsonStatus,"{");
-    strcat(jsonStatus,"\"broker\":\"");
-    strcat(jsonStatus,settings.mqttBrokerAddress);
-    strcat(jsonStatus,"\", \"port\":");
-    sprintf(tempbuf,"%d",settings.mqttBrokerPort);
-    strcat(jsonStatus,tempbuf);
-    strcat(jsonStatus,", \"mqttTopic\":\"");
-    strcat(jsonStatus,settings.mqttTopic);
-    strcat(jsonStatus,"\", \"user\":\"");
-    strcat(jsonStatus,settings.mqttUsername);
-    strcat(jsonStatus,"\", \"pass\":\"");
-    strcat(jsonStatus,settings.mqttPassword);
-    strcat(jsonStatus,"\", \"ssid\":\"");
-    strcat(jsonStatus,settings.ssid);
-    strcat(jsonStatus,"\", \"wifipass\":\"");
-    strcat(jsonStatus,settings.wifiPassword);
-    strcat(jsonStatus,"\", \"sleepTime\":\"");
-    sprintf(tempbuf,"%d",settings.sleepTime);
-    strcat(jsonStatus,tempbuf);
-    strcat(jsonStatus,"\", \"mqttClientId\":\"");
-    strcat(jsonStatus,settings.mqttClientId);
-    strcat(jsonStatus,"\", \"address\":\"");
-    strcat(jsonStatus,settings.address);
-    strcat(jsonStatus,"\", \"netmask\":\"");
-    strcat(jsonStatus,settings.netmask);
-    strcat(jsonStatus,"\",\"IP Address\":\"");
-    strcat(jsonStatus,WiFi.localIP().toString().c_str());
-    
-    strcat(jsonStatus,"\"}");
-    response=jsonStatus;
+    response=NULL; //streamed below rather than built here
     }
-  else if (strcmp(charbuf,MQTT_PAYLOAD_STATUS_COMMAND)==0) //show the latest value
+  else if (strcmp(command,MQTT_PAYLOAD_TRACE_COMMAND)==0) //the dump is the response
+    {
+    if (!publishTrace())
+      TRACE_ERROR(EVENT_PUBLISH_FAILED,mqttClient.state(),"************ Failure when publishing trace!\n");
+    return;
+    }
+  else if (strcmp(command,MQTT_PAYLOAD_STATUS_COMMAND)==0) //show the latest value
     {
     report();
-    
-    char tmp[25];
-    strcpy(tmp,"Status report complete");
-    response=tmp;
+    response="Status report complete";
     }
-  else if (strcmp(charbuf,MQTT_PAYLOAD_REBOOT_COMMAND)==0) //reboot the controller
+  else if (strcmp(command,MQTT_PAYLOAD_REBOOT_COMMAND)==0) //reboot the controller
     {
-    char tmp[10];
-    strcpy(tmp,"REBOOTING");
-    response=tmp;
+    response="REBOOTING";
     rebootScheduled=true;
     }
-  else if (processCommand(charbuf))
+  else if (processCommand(command)) //leaves just the setting name in command
     {
     response="OK";
     }
   else
     {
-    char badCmd[18];
-    strcpy(badCmd,"(empty)");
-    response=badCmd;
+    response="(empty)";
     }
     
-  char topic[MQTT_TOPIC_SIZE];
-  strcpy(topic,settings.mqttTopic);
-  strcat(topic,charbuf); //the incoming command becomes the topic suffix
-
-  if (!publish(topic,response,false)) //do not retain
-    Serial.println("************ Failure when publishing status response!");
-  
-  if (rebootScheduled)
+  if (snprintf(topic,sizeof(topic),"%s%s",settings.mqttTopic,command)>=(int)sizeof(topic)) //the incoming command becomes the topic suffix
+    TRACE_WARN(EVENT_COMMAND,length,"************ Response topic is too long, no response sent!\n");
+  else if (response==NULL)
     {
-    delay(2000); //give publish time to complete
-    ESP.restart();
+    if (!publishJson(topic,writeSettingsJson,false)) //do not retain
+      TRACE_ERROR(EVENT_PUBLISH_FAILED,mqttClient.state(),"************ Failure when publishing settings!\n");
     }
+  else if (!publish(topic,response,false)) //do not retain
+    TRACE_ERROR(EVENT_PUBLISH_FAILED,mqttClient.state(),"************ Failure when publishing status response!\n");
+  
+  if (rebootScheduled)
+    restartProcessor();
   }
 
 
 void showSettings()
   {
-  Serial.print("ssid=<wifi ssid> (");
-  Serial.print(settings.ssid);
-  Serial.println(")");
-  Serial.print("wifipass=<wifi password> (");
-  Serial.print(settings.wifiPassword);
-  Serial.println(")");
-  Serial.print("broker=<MQTT broker host name or address> (");
-  Serial.print(settings.mqttBrokerAddress);
-  Serial.println(")");
-  Serial.print("port=<port number>   (");
-  Serial.print(settings.mqttBrokerPort);
-  Serial.println(")");
-  Serial.print("user=<mqtt user> (");
-  Serial.print(settings.mqttUsername);
-  Serial.println(")");
-  Serial.print("pass=<mqtt password> (");
-  Serial.print(settings.mqttPassword);
-  Serial.println(")");
-  Serial.print("mqttTopic=<topic root> (");
-  Serial.print(settings.mqttTopic);
-  Serial.println(")  Note: must end with \"/\"");  
-  Serial.print("sleeptime=<seconds to sleep between measurements> (");
-  Serial.print(settings.sleepTime);
-  Serial.println(")");
-  Serial.print("address=<Static IP address if so desired> (");
-  Serial.print(settings.address);
-  Serial.println(")");
-  Serial.print("netmask=<Network mask to be used with static IP> (");
-  Serial.print(settings.netmask);
-  Serial.println(")");
-  Serial.print("debug=1|0 (");
-  Serial.print(settings.debug);
+  char value[SETTING_VALUE_SIZE];
+  for (size_t i=0; i<SETTING_COUNT; i++)
+    {
+    const settingDescriptor* setting=&settingTable[i];
+    if (setting->flags & SETTING_READONLY)
+      continue;
+    settingToString(setting,value,sizeof(value));
+    Serial.print(setting->name);
+    Serial.print("=");
+    Serial.print(setting->help);
+    Serial.print(" (");
+    Serial.print(value);
+    Serial.println(")");
+    }
+  char table[CAL_TEXT_SIZE];
+  calibrationToString(table);
+  Serial.print("calibrate=<millivolts measured now>|<raw>:<millivolts>|clear (");
+  Serial.print(table);
   Serial.println(")");
   Serial.print("MQTT Client ID is ");
   Serial.println(settings.mqttClientId);
@@ -430,411 +1157,1630 @@ void showSettings()
   Serial.println("*** Use \"factorydefaults=yes\" to reset all settings  ***");
   Serial.println("*** Use \"reset=yes\" to restart the processor  ***");
   Serial.println("*** Use a simple \"w\" to prevent sleep until restart  ***");
+  Serial.println("*** Use \"trace\" to show the latest events  ***");
   
   Serial.print("\nSettings are ");
   Serial.println(settingsAreValid?"complete.":"incomplete.");
   }
 
 /*
- * Reconnect to the MQTT broker
+ * Make one attempt to connect to the MQTT broker. It takes at most MQTT_CONNECT_TIMEOUT,
+ * and runReport() decides whether there is time to try again.
  */
-boolean reconnect() 
+boolean connectMqtt()
   {
-  // Loop until we're reconnected or times out
-  uint8 tries=MQTT_RECONNECT_TRIES;
-  while (!mqttClient.connected() && tries-- > 0) 
-    {      
-    Serial.print("Attempting MQTT connection...");
+  // The session is kept by the broker while we sleep, so our subscription survives and
+  // commands sent meanwhile are held for us.
+  if (!setBrokerAddress()
+      || !mqttClient.connect(settings.mqttClientId,settings.mqttUsername,settings.mqttPassword,NULL,0,false,NULL,false))
+    {
+    TRACE_ERROR(EVENT_MQTT_FAILED,mqttClient.state(),"MQTT connection failed, rc=%d.\n",mqttClient.state());
+    rtc.brokerIP=0; //maybe it moved, so look it up again
+    return false;
+    }
+  TRACE_INFO(EVENT_MQTT_UP,millis(),"Connected to MQTT broker.\n");
 
-    mqttClient.setBufferSize(JSON_STATUS_SIZE); //default (256) isn't big enough
-    mqttClient.setServer(settings.mqttBrokerAddress, settings.mqttBrokerPort);
-    mqttClient.setCallback(incomingMqttHandler);
-    
-    // Attempt to connect
-    if (mqttClient.connect(settings.mqttClientId,settings.mqttUsername,settings.mqttPassword))
-      {
-      Serial.println("connected to MQTT broker.");
-
-      //resubscribe to the incoming message topic
-      char topic[MQTT_TOPIC_SIZE];
-      strcpy(topic,settings.mqttTopic);
-      strcat(topic,MQTT_TOPIC_COMMAND_REQUEST);
-      bool subgood=mqttClient.subscribe(topic);
-      showSub(topic,subgood);
-      }
-    else 
+  //subscribe to the incoming message topic, unless the session already has it
+  uint32_t session=sessionKey();
+  if (rtc.session!=session)
+    {
+    char topic[MQTT_TOPIC_SIZE];
+    strcpy(topic,settings.mqttTopic);
+    strcat(topic,MQTT_TOPIC_COMMAND_REQUEST);
+    bool subgood=mqttClient.subscribe(topic,1); //QoS 1 so the broker queues commands while we sleep
+    TRACE_INFO(EVENT_SUBSCRIBE,subgood,"Subscribed to %s: %d\n",topic,subgood);
+    rtc.session=subgood?session:0;
+    }
+  serviceMqtt(); //This has to happen every so often or we get disconnected for some reason
+  return mqttClient.connected();
+  }
+
+/*
+ * Point the MQTT client at the broker. A name is looked up once and the address kept
+ * in RTC memory, so most wakes skip the DNS round trip. It's looked up again after
+ * BROKER_LOOKUP_INTERVAL, when the broker setting changes, or after a failed connection.
+ */
+boolean setBrokerAddress()
+  {
+  IPAddress address;
+  if (address.fromString(settings.mqttBrokerAddress)) //nothing to look up
+    {
+    mqttClient.setServer(address,settings.mqttBrokerPort);
+    return true;
+    }
+
+  uint32_t name=calculateCRC32((const uint8_t*)settings.mqttBrokerAddress,strlen(settings.mqttBrokerAddress));
+  uint32_t minute=(rtc.elapsedMs+millis())/60000;
+  if (rtc.brokerIP==0 || rtc.brokerName!=name || minute-rtc.brokerLookupMinute>=BROKER_LOOKUP_INTERVAL)
+    {
+    if (WiFi.hostByName(settings.mqttBrokerAddress,address,DNS_TIMEOUT)!=1)
       {
-      Serial.print("failed, rc=");
-      Serial.println(mqttClient.state());
-      Serial.println("Will try again in a second");
-      
-      // Wait a second before retrying
-      // In the meantime check for input in case something needs to be changed to make it work
-      checkForCommand(); 
-      
-      delay(1000);
+      TRACE_ERROR(EVENT_DNS,0,"************ Can't find the address of %s!\n",settings.mqttBrokerAddress);
+      return false;
       }
+    rtc.brokerIP=(uint32_t)address;
+    rtc.brokerName=name;
+    rtc.brokerLookupMinute=minute;
+    TRACE_DEBUG(EVENT_DNS,rtc.brokerIP,"Broker %s is at %s\n",settings.mqttBrokerAddress,address.toString().c_str());
     }
-  mqttClient.loop(); //This has to happen every so often or we get disconnected for some reason
-  return mqttClient.connected();
+  mqttClient.setServer(IPAddress(rtc.brokerIP),settings.mqttBrokerPort);
+  return true;
   }
 
-void showSub(char* topic, bool subgood)
+/*
+ * Identifies the broker session our subscription lives in. PubSubClient doesn't tell
+ * us whether the broker still had the session, so we remember which one we subscribed
+ * in and assume it is still there, until our own sleep command fails to come back.
+ */
+uint32_t sessionKey()
   {
-  Serial.print("++++++Subscribing to ");
-  Serial.print(topic);
-  Serial.print(":");
-  Serial.println(subgood);
+  uint32_t key[4];
+  key[0]=calculateCRC32((const uint8_t*)settings.mqttClientId,strlen(settings.mqttClientId));
+  key[1]=calculateCRC32((const uint8_t*)settings.mqttBrokerAddress,strlen(settings.mqttBrokerAddress));
+  key[2]=calculateCRC32((const uint8_t*)settings.mqttTopic,strlen(settings.mqttTopic));
+  key[3]=settings.mqttBrokerPort;
+  return calculateCRC32((const uint8_t*)key,sizeof(key))|1; //never zero, which means no session
   }
 
-  
 /*
- * Check for configuration input via the serial port.  Return a null string 
- * if no input is available or return the complete line otherwise.
+ * Let the MQTT client do its work, which includes running incomingMqttHandler() for
+ * anything that has arrived. A restart asked for by a command waits until then, so
+ * the client has acknowledged the command and the broker won't send it again.
  */
-String getConfigCommand()
+void serviceMqtt()
   {
-  if (commandComplete) 
+  inMqttLoop=true;
+  mqttClient.loop();
+  inMqttLoop=false;
+  if (restartPending)
     {
-    Serial.println(commandString);
-    String newCommand=commandString;
-
-    commandString = "";
-    commandComplete = false;
-    return newCommand;
+    restartPending=false;
+    restartProcessor();
     }
-  else return "";
   }
 
-bool processCommand(String cmd)
+void restartProcessor()
   {
-  const char *str=cmd.c_str();
-  char *val=NULL;
-  char *nme=strtok((char *)str,"=");
-  if (nme!=NULL)
-    val=strtok(NULL,"=");
-
-  char zero[]=""; //zero length string
+  if (inMqttLoop)
+    {
+    restartPending=true;
+    return;
+    }
+  TRACE_WARN(EVENT_RESTART,0,"Restarting processor.\n");
+  if (step!=STEP_IDLE && step<STEP_PUBLISH) //a queued command can get here before the report is out
+    keepReading(reportReading);
+  delay(2000); //give publish time to complete
+  rtc.elapsedMs+=millis();
+  saveRTC(); //keep the readings, counters and caches, as a sleep would
+  ESP.restart();
+  }
 
-  //Get rid of the carriage return and/or linefeed. Twice because could have both.
-  if (val!=NULL && strlen(val)>0 && (val[strlen(val)-1]==13 || val[strlen(val)-1]==10))
-    val[strlen(val)-1]=0; 
-  if (val!=NULL && strlen(val)>0 && (val[strlen(val)-1]==13 || val[strlen(val)-1]==10))
-    val[strlen(val)-1]=0; 
+  
+/*
+ * Split a "name=value" command in place. The name is terminated where the '=' was,
+ * and line ends are trimmed from the value. Returns the value, which is empty if
+ * there is no '='.
+ */
+char* splitCommand(char* cmd)
+  {
+  size_t len=strlen(cmd);
+  while (len>0 && (cmd[len-1]=='\r' || cmd[len-1]=='\n'))
+    cmd[--len]='\0';
+  char* val=strchr(cmd,'=');
+  if (val==NULL)
+    return cmd+len; //the terminator, an empty string
+  *val='\0';
+  return val+1;
+  }
 
-  //do it for the command as well.  Might not even have a value.
-  if (nme!=NULL && strlen(nme)>0 && (nme[strlen(nme)-1]==13 || nme[strlen(nme)-1]==10))
-    nme[strlen(nme)-1]=0; 
-  if (nme!=NULL && strlen(nme)>0 && (nme[strlen(nme)-1]==13 || nme[strlen(nme)-1]==10))
-    nme[strlen(nme)-1]=0; 
+/*
+ * Carry out a command. cmd is split up in place, so afterwards it holds just the name.
+ */
+bool processCommand(char* cmd)
+  {
+  char* nme=cmd;
+  char* val=splitCommand(cmd);
 
-  if (settings.debug)
-    {
-    Serial.print("Processing command \"");
-    Serial.print(nme);
-    Serial.println("\"");
-    Serial.print("Length:");
-    Serial.println(strlen(nme));
-    Serial.print("Hex:");
-    Serial.println(nme[0],HEX);
-    Serial.print("Value is \"");
-    Serial.print(val);
-    Serial.println("\"\n");
-    }
+  TRACE_DEBUG(EVENT_COMMAND,strlen(nme),"Processing command \"%s\", value \"%s\"\n",nme,val);
 
+  transactionActivity=millis(); //any command keeps a transaction going
   bool needRestart=true; //most changes will need a restart
+  bool needSave=true; //and most change a setting
+  const settingDescriptor* setting;
 
-  if (val==NULL)
-    val=zero;
-
-  if (nme==NULL || val==NULL || strlen(nme)==0) //empty string is a valid val value
+  if (strlen(nme)==0)
     {
     showSettings();
     return false;   //not a valid command, or it's missing
     }
   else if (strcmp(val,"NULL")==0) //to nullify a value, you have to really mean it
     {
-    strcpy(val,"");
+    val[0]='\0';
     }
   
-  if (strcmp(nme,"w")==0)
-    {
-    stayAwake=true;
-    needRestart=false;
-    Serial.println("Staying awake until next reset.");
-    }
-  else if (strcmp(nme,"broker")==0)
-    {
-    strcpy(settings.mqttBrokerAddress,val);
-    saveSettings();
-    }
-  else if (strcmp(nme,"port")==0)
-    {
-    if (!val)
-      strcpy(val,"0");
-    settings.mqttBrokerPort=atoi(val);
-    saveSettings();
-    }
-  else if (strcmp(nme,"mqttTopic")==0)
-    {
-    strcpy(settings.mqttTopic,val);
-    saveSettings();
-    }
-  else if (strcmp(nme,"user")==0)
-    {
-    strcpy(settings.mqttUsername,val);
-    saveSettings();
-    }
-  else if (strcmp(nme,"pass")==0)
+  if (strcmp(nme,"begin")==0)
     {
-    strcpy(settings.mqttPassword,val);
-    saveSettings();
+    beginTransaction();
+    return true;
     }
-  else if (strcmp(nme,"ssid")==0)
+  else if (strcmp(nme,"abort")==0)
     {
-    strcpy(settings.ssid,val);
-    saveSettings();
+    abortTransaction();
+    return true;
     }
-  else if (strcmp(nme,"wifipass")==0)
+  else if (strcmp(nme,"commit")==0)
     {
-    strcpy(settings.wifiPassword,val);
-    saveSettings();
+    char summary[TRANSACTION_SUMMARY_SIZE];
+    needRestart=commitTransaction(summary);
+    needSave=false;
     }
-  else if (strcmp(nme,"address")==0)
+  else if (strcmp(nme,"w")==0)
     {
-    strcpy(settings.address,val);
-    saveSettings();
+    stayAwake=true;
+    needRestart=false;
+    needSave=false;
+    Serial.println("Staying awake until next reset.");
     }
-  else if (strcmp(nme,"netmask")==0)
+  else if ((setting=findSetting(nme))!=NULL && !(setting->flags & SETTING_READONLY))
     {
-    strcpy(settings.netmask,val);
-    saveSettings();
+    if (!applySetting(setting,val))
+      return rejectCommand(nme);
+    needRestart=(setting->flags & SETTING_RESTART)!=0;
     }
-  else if (strcmp(nme,"sleepTime")==0)
+  else if (strcmp(nme,"trace")==0)
     {
-    if (!val)
-      strcpy(val,"0");
-    settings.sleepTime=atoi(val);
-    saveSettings();
+    showTrace();
     needRestart=false;
+    needSave=false;
     }
-  else if (strcmp(nme,"debug")==0)
+  else if (strcmp(nme,"calibrate")==0)
     {
-    if (!val)
-      strcpy(val,"0");
-    settings.debug=atoi(val)==1?true:false;
-    saveSettings();
+    if (!calibrate(val))
+      return rejectCommand(nme);
     needRestart=false;
     }
   else if ((strcmp(nme,"resetmqttid")==0)&& (strcmp(val,"yes")==0))
     {
     generateMqttClientId(settings.mqttClientId);
-    saveSettings();
     }
  else if ((strcmp(nme,"factorydefaults")==0) && (strcmp(val,"yes")==0)) //reset all eeprom settings
     {
     Serial.println("\n*********************** Resetting EEPROM Values ************************");
     initializeSettings();
-    saveSettings();
     }
   else if ((strcmp(nme,"reset")==0) && (strcmp(val,"yes")==0)) //reset the device
     {
     Serial.println("\n*********************** Resetting Device ************************");
+    needSave=false;
     }
   else
     {
+    if (inTransaction)
+      return rejectCommand(nme);
     showSettings();
     return false; //command not found
     }
 
-  if (needRestart)
+  if (inTransaction) //hold it until the commit
     {
-    Serial.println("Restarting processor.");
-    delay(2000);
-    ESP.restart();
+    noteKey(transactionApplied,nme);
+    transactionRestart=transactionRestart || needRestart;
+    return true;
     }
+
+  if (needSave)
+    saveSettings();
+  if (needRestart)
+    restartProcessor();
   return true;
   }
 
-void initializeSettings()
+/*
+ * Settings can be changed several at a time. After "begin", each key=value is
+ * checked and applied in memory only. "commit" writes them to EEPROM once and
+ * restarts at most once; "abort" throws them away, as does TRANSACTION_TIMEOUT
+ * without a command.
+ */
+void beginTransaction()
   {
-  settings.validConfig=0; 
-  strcpy(settings.ssid,"");
-  strcpy(settings.wifiPassword,"");
-  strcpy(settings.mqttBrokerAddress,""); //default
-  settings.mqttBrokerPort=1883;
-  strcpy(settings.mqttUsername,"");
-  strcpy(settings.mqttPassword,"");
-  strcpy(settings.mqttTopic,"");
-  strcpy(settings.address,"");
-  strcpy(settings.netmask,"255.255.255.0");
-  settings.sleepTime=10;
-  generateMqttClientId(settings.mqttClientId);
+  inTransaction=true;
+  transactionRestart=false;
+  transactionActivity=millis();
+  strcpy(transactionApplied,"");
+  strcpy(transactionRejected,"");
+  Serial.println("Transaction started. Send settings, then \"commit\" or \"abort\".");
   }
 
+void abortTransaction()
+  {
+  if (inTransaction)
+    {
+    inTransaction=false;
+    loadSettings(); //put back what's in EEPROM
+    Serial.println("Transaction aborted, nothing was changed.");
+    }
+  }
 
-void checkForCommand()
+/*
+ * Save the settings changed in the transaction and describe what was done in
+ * summary, which must hold TRANSACTION_SUMMARY_SIZE characters. Returns true if
+ * one of the changes needs a restart.
+ */
+boolean commitTransaction(char* summary)
   {
-  serialEvent();
-  String cmd=getConfigCommand();
-  if (cmd.length()>0)
+  boolean restart=inTransaction && transactionRestart;
+  if (inTransaction && strlen(transactionApplied)>0)
+    saveSettings();
+  inTransaction=false;
+  sprintf(summary,"applied:%s rejected:%s",transactionApplied,transactionRejected);
+  Serial.println(summary);
+  return restart;
+  }
+
+/*
+ * A setting's value isn't acceptable. In a transaction, remember it for the summary.
+ */
+boolean rejectCommand(const char* nme)
+  {
+  Serial.print("Value for \"");
+  Serial.print(nme);
+  Serial.println("\" is not valid, ignored.");
+  if (inTransaction)
+    noteKey(transactionRejected,nme);
+  return false;
+  }
+
+/*
+ * Add a key to a comma separated list of TRANSACTION_KEYS_SIZE characters, if it fits.
+ */
+void noteKey(char* list, const char* key)
+  {
+  if (strlen(list)+strlen(key)+2<=TRANSACTION_KEYS_SIZE)
     {
-    processCommand(cmd);
+    if (strlen(list)>0)
+      strcat(list,",");
+    strcat(list,key);
     }
   }
 
-int readBattery()
+/*
+ * Find a setting by name. Hashes are unique, so a matching hash is the one, but the
+ * name is still checked in case it's a command that isn't in the table.
+ */
+const settingDescriptor* findSetting(const char* name)
   {
-  int raw=ESP.getVcc(); //This commandeers the ADC port
-  if (settings.debug)
+  uint32_t hash=settingHash(name);
+  for (uint32_t bucket=hash%SETTING_BUCKETS; settingLookup.slot[bucket]!=-1; bucket=(bucket+1)%SETTING_BUCKETS)
     {
-    Serial.print("Raw voltage count:");
-    Serial.println(raw);
+    const settingDescriptor* setting=&settingTable[settingLookup.slot[bucket]];
+    if (setting->hash==hash)
+      return strcmp(setting->name,name)==0?setting:NULL;
     }
-  return raw;
+  return NULL;
   }
 
-float convertToVoltage(int raw)
+/*
+ * Set a setting from its text value. An empty value sets the default. Returns false,
+ * leaving the setting alone, if the value isn't acceptable.
+ */
+boolean applySetting(const settingDescriptor* setting, const char* val)
   {
-  int vcc=map(raw,0,FULL_BATTERY,0,FULL_VOLTAGE);
-  float f=((float)vcc)/100.0;
-  return f;
+  uint8_t* field=(uint8_t*)&settings+setting->offset;
+  boolean useDefault=strlen(val)==0;
+  switch (setting->type)
+    {
+    case SETTING_TEXT:
+      if (useDefault)
+        val=setting->initialText;
+      if (strlen(val)>=setting->size)
+        return false;
+      strcpy((char*)field,val);
+      return true;
+
+    case SETTING_BOOL:
+      *(bool*)field=useDefault?setting->initial!=0:atoi(val)==1;
+      return true;
+
+    case SETTING_CHOICE:
+      {
+      int value=useDefault?setting->initial:-1;
+      for (int i=0; i<=setting->maximum && value<0; i++)
+        {
+        if (strcmp(val,setting->choices[i])==0)
+          value=i;
+        }
+      if (value<0)
+        return false;
+      *(int*)field=value;
+      return true;
+      }
+
+    default: //SETTING_INT
+      {
+      int value=useDefault?setting->initial:atoi(val);
+      if (value<setting->minimum || value>setting->maximum)
+        {
+        if (!(setting->flags & SETTING_CLAMP))
+          return false;
+        value=constrain(value,setting->minimum,setting->maximum);
+        }
+      *(int*)field=value;
+      return true;
+      }
+    }
   }
 
+/*
+ * Put a setting's value into buf as text.
+ */
+void settingToString(const settingDescriptor* setting, char* buf, size_t size)
+  {
+  const uint8_t* field=(const uint8_t*)&settings+setting->offset;
+  switch (setting->type)
+    {
+    case SETTING_TEXT:
+      snprintf(buf,size,"%s",(const char*)field);
+      break;
+    case SETTING_BOOL:
+      snprintf(buf,size,"%d",*(const bool*)field?1:0);
+      break;
+    case SETTING_CHOICE:
+      snprintf(buf,size,"%s",setting->choices[*(const int*)field]);
+      break;
+    default:
+      snprintf(buf,size,"%d",*(const int*)field);
+      break;
+    }
+  }
 
-/************************
- * Do the MQTT thing
- ************************/
-void report()
-  {  
-  char topic[MQTT_TOPIC_SIZE];
-  char reading[18];
-  boolean success=false;
-  int analog=readBattery();
+/*
+ * Anything in the EEPROM copy that's out of range, like the erased flash a newer
+ * setting finds there, goes back to its default.
+ */
+void sanitizeSettings()
+  {
+  for (size_t i=0; i<SETTING_COUNT; i++)
+    {
+    const settingDescriptor* setting=&settingTable[i];
+    const uint8_t* field=(const uint8_t*)&settings+setting->offset;
+    boolean bad;
+    if (setting->type==SETTING_TEXT)
+      bad=memchr(field,'\0',setting->size)==NULL;
+    else if (setting->type==SETTING_BOOL)
+      bad=*field>1;
+    else
+      bad=*(const int*)field<setting->minimum || *(const int*)field>setting->maximum;
+    if (bad)
+      applySetting(setting,"");
+    }
 
-  Serial.print("Publishing from address ");
-  Serial.println(WiFi.localIP());
+  boolean calGood=settings.calCount<=CAL_POINTS; //an unwritten table is all ones
+  for (int i=0; calGood && i<settings.calCount; i++)
+    calGood=settings.calRaw[i]>0 && settings.calRaw[i]<=CAL_MAX
+      && settings.calMillivolts[i]>0 && settings.calMillivolts[i]<=CAL_MAX
+      && (i==0 || settings.calRaw[i]>settings.calRaw[i-1]);
+  if (!calGood)
+    settings.calCount=0;
+  }
 
-  //publish the raw battery reading
-  strcpy(topic,settings.mqttTopic);
-  strcat(topic,MQTT_TOPIC_ANALOG);
-  sprintf(reading,"%d",analog); 
-  success=publish(topic,reading,true); //retain
-  if (!success)
-    Serial.println("************ Failed publishing raw battery reading!");
+void initializeSettings()
+  {
+  settings.validConfig=0; 
+  for (size_t i=0; i<SETTING_COUNT; i++)
+    applySetting(&settingTable[i],""); //empty means the default
+  settings.calCount=0;
+  generateMqttClientId(settings.mqttClientId);
+  }
 
-  //publish the battery voltage
-  strcpy(topic,settings.mqttTopic);
-  strcat(topic,MQTT_TOPIC_BATTERY);
-  sprintf(reading,"%.2f",convertToVoltage(analog)); 
-  success=publish(topic,reading,true); //retain
-  if (!success)
-    Serial.println("************ Failed publishing battery voltage!");
 
-  if (stayAwake)
-    Serial.println("Staying awake until next reset.");
+void checkForCommand()
+  {
+  serialEvent();
+  if (commandComplete)
+    {
+    commandLine[commandLength]='\0';
+    if (commandOverflow)
+      Serial.println("************ Command is too long, ignored!");
+    else if (commandLength>0)
+      {
+      Serial.println(commandLine);
+      processCommand(commandLine);
+      }
+    commandLength=0;
+    commandComplete=false;
+    commandOverflow=false;
+    }
   }
 
-boolean publish(char* topic, const char* reading, boolean retain)
+int readBattery()
   {
-  Serial.print(topic);
-  Serial.print(" ");
-  Serial.println(reading);
-  return mqttClient.publish(topic,reading,retain); 
+  int raw=ESP.getVcc(); //This commandeers the ADC port
+  TRACE_DEBUG(EVENT_SAMPLE,raw,"Raw voltage count: %d\n",raw);
+  return raw;
   }
 
-  
 /*
-*  Initialize the settings from eeprom and determine if they are valid
-*/
-void loadSettings()
+ * Take a burst of samples and filter them into one reading. The samples are sorted,
+ * the highest and lowest are thrown out, and the rest are averaged. This gets rid of
+ * the dips caused by WiFi transmit current spikes. The variance of the whole burst is
+ * kept so the quality of the reading can be reported with it.
+ */
+int measure()
   {
-  EEPROM.get(0,settings);
-  if (settings.validConfig==VALID_SETTINGS_FLAG)    //skip loading stuff if it's never been written
+  int n=settings.sampleCount;
+  uint16_t samples[MAX_SAMPLE_COUNT];
+  int64_t sum=0;
+  int64_t sumSquares=0;
+  for (int i=0; i<n; i++)
     {
-    settingsAreValid=true;
-    if (settings.debug)
-      {
-      Serial.println("Loaded configuration values from EEPROM");
-      }
+    if (i>0)
+      delayMicroseconds(SAMPLE_SPACING);
+    uint16_t s=readBattery();
+
+    //insertion sort as we go, it's only a few samples
+    int j=i;
+    for (; j>0 && samples[j-1]>s; j--)
+      samples[j]=samples[j-1];
+    samples[j]=s;
+
+    sum+=s;
+    sumSquares+=(int64_t)s*s;
     }
-  else
+
+  int trim=n/SAMPLE_TRIM;
+  int32_t kept=0;
+  for (int i=trim; i<n-trim; i++)
+    kept+=samples[i];
+  lastReading=(kept+(n-2*trim)/2)/(n-2*trim); //rounded
+  lastVariance=(unsigned int)((n*sumSquares-sum*sum)/((int64_t)n*n));
+
+  TRACE_INFO(EVENT_READING,lastReading,"Reading %d, battery voltage %u mV, variance %u\n",lastReading,toMillivolts(lastReading),lastVariance);
+  updateHistory(lastReading);
+  return lastReading;
+  }
+
+/*
+ * Average the readings over HISTORY_INTERVAL minutes and add a point to the
+ * discharge history when the interval is up. The oldest point is dropped when
+ * the history is full.
+ */
+void updateHistory(int raw)
+  {
+  uint16_t now=(uint16_t)((rtc.elapsedMs+millis())/60000); //minutes, wrapping every 45 days
+  if (rtc.historyCount==0)
+    rtc.historyStart=now;
+  rtc.historySum+=raw;
+  rtc.historyCount++;
+
+  uint16_t span=now-rtc.historyStart;
+  if (span>=HISTORY_INTERVAL)
     {
-    Serial.println("Skipping load from EEPROM, device not configured.");    
-    settingsAreValid=false;
+    if (rtc.historyLength==HISTORY_SIZE)
+      {
+      rtc.historyHead=(rtc.historyHead+1)%HISTORY_SIZE;
+      rtc.historyLength--;
+      }
+    int i=(rtc.historyHead+rtc.historyLength)%HISTORY_SIZE;
+    rtc.historyReading[i]=(rtc.historySum+rtc.historyCount/2)/rtc.historyCount;
+    rtc.historyTime[i]=rtc.historyStart+span/2; //the middle of the interval
+    rtc.historyLength++;
+    rtc.historyCount=0;
+    rtc.historySum=0;
     }
   }
 
 /*
- * Save the settings to EEPROM. Set the valid flag if everything is filled in.
+ * Fit a straight line to the discharge history by least squares and use it to
+ * estimate the discharge rate (hundredths of a raw count per day, negative while discharging) and
+ * the hours left until the reading reaches EMPTY_BATTERY. Returns false if there
+ * isn't enough history or the battery isn't discharging.
  */
-boolean saveSettings()
+boolean estimateLife(int32_t* ratePerDay, int32_t* hoursLeft)
   {
-  if (strlen(settings.ssid)>0 &&
-    strlen(settings.wifiPassword)>0 &&
-    strlen(settings.mqttBrokerAddress)>0 &&
-    settings.mqttBrokerPort!=0 &&
-    strlen(settings.mqttTopic)>0 &&
-    strlen(settings.mqttClientId)>0)
+  int n=rtc.historyLength;
+  if (n<3)
+    return false;
+
+  //x is minutes before the newest point, so the intercept is the fitted reading now
+  uint16_t newest=rtc.historyTime[(rtc.historyHead+n-1)%HISTORY_SIZE];
+  int64_t sx=0, sy=0, sxx=0, sxy=0;
+  for (int i=0; i<n; i++)
     {
-    Serial.println("Settings deemed complete");
-    settings.validConfig=VALID_SETTINGS_FLAG;
-    settingsAreValid=true;
+    int j=(rtc.historyHead+i)%HISTORY_SIZE;
+    int64_t x=-(int64_t)(uint16_t)(newest-rtc.historyTime[j]);
+    int64_t y=rtc.historyReading[j];
+    sx+=x;
+    sy+=y;
+    sxx+=x*x;
+    sxy+=x*y;
     }
-  else
+  int64_t num=n*sxy-sx*sy; //slope is num/den counts per minute
+  int64_t den=n*sxx-sx*sx;
+  if (den<=0)
+    return false;
+
+  *ratePerDay=(int32_t)(num*144000/den);
+  if (num>=0)
+    return false; //not discharging, or too slowly to tell
+
+  int64_t intercept=(sy*den-num*sx)/(n*den);
+  int64_t remaining=intercept-EMPTY_BATTERY;
+  *hoursLeft=remaining<=0 ? 0 : (int32_t)(remaining*den/(-num)/60);
+  return true;
+  }
+
+/*
+ * Battery voltage for a raw reading, by straight-line interpolation between the points
+ * of the calibration table, or extrapolation from its end segments. A single point
+ * gives a line through zero. It's all integer, so no float code is pulled in.
+ */
+uint16_t toMillivolts(int raw)
+  {
+  int32_t x0=0,y0=0; //the segment the reading falls in
+  int32_t x1=FULL_BATTERY,y1=FULL_VOLTAGE*10;
+  if (settings.calCount==1)
     {
-    Serial.println("Settings still incomplete");
-    settings.validConfig=0;
-    settingsAreValid=false;
+    x1=settings.calRaw[0];
+    y1=settings.calMillivolts[0];
     }
-    
-  //The mqttClientId is not set by the user, but we need to make sure it's set  
-  if (strlen(settings.mqttClientId)==0)
+  else if (settings.calCount>1)
     {
-    generateMqttClientId(settings.mqttClientId);
+    int i=1;
+    while (i<settings.calCount-1 && raw>settings.calRaw[i])
+      i++;
+    x0=settings.calRaw[i-1];
+    y0=settings.calMillivolts[i-1];
+    x1=settings.calRaw[i];
+    y1=settings.calMillivolts[i];
     }
-    
-  EEPROM.put(0,settings);
-  return EEPROM.commit();
+  int32_t span=x1-x0;
+  int32_t num=(constrain(raw,0,CAL_MAX)-x0)*(y1-y0); //under 2^30 in magnitude
+  int32_t mv=y0+(num+(num<0?-span/2:span/2))/span; //rounded
+  return constrain(mv,0,0xffff);
   }
 
-
-//Generate an MQTT client ID.  This should not be necessary very often
-char* generateMqttClientId(char* mqttId)
+/*
+ * Millivolts as volts with two decimals, the way the battery topic has always had it.
+ */
+char* formatVolts(uint16_t millivolts, char* buf)
   {
-  char mcir[]=MQTT_CLIENT_ID_ROOT;
-  strcpy(mqttId,strcat(mcir,String(random(0xffff), HEX).c_str()));
-  if (settings.debug)
-    {
-    Serial.print("New MQTT userid is ");
-    Serial.println(mqttId);
-    }
-  return mqttId;
+  unsigned int centivolts=(millivolts+5)/10;
+  sprintf(buf,"%u.%02u",centivolts/100,centivolts%100);
+  return buf;
   }
-  
+
 /*
-  SerialEvent occurs whenever a new data comes in the hardware serial RX. This
-  routine is run between each time loop() runs, so using delay inside loop can
-  delay response. Multiple bytes of data may be available.
-*/
-void serialEvent() 
+ * Add a point to the calibration table. The value is the battery voltage in millivolts
+ * measured right now, or raw:millivolts for a reading taken some other time, or
+ * "clear" to empty the table. A point within CAL_MERGE counts of one already there
+ * replaces it, and when the table is full the nearest point makes way.
+ */
+boolean calibrate(const char* val)
   {
-  while (Serial.available()) 
+  if (strcmp(val,"clear")==0)
     {
-    // get the new byte
-    char inChar = (char)Serial.read();
-    Serial.print(inChar); //echo it back to the terminal
+    settings.calCount=0;
+    return true;
+    }
 
-    // if the incoming character is a newline, set a flag so the main loop can
-    // do something about it 
-    if (inChar == '\n') 
-      {
-      commandComplete = true;
-      }
-    else
+  const char* colon=strchr(val,':');
+  const char* mvText=colon?colon+1:val;
+  char* end;
+  long mv=strtol(mvText,&end,10);
+  if (end==mvText || *end!='\0' || mv<=0 || mv>CAL_MAX)
+    return false;
+  long raw;
+  if (colon)
+    {
+    raw=strtol(val,&end,10);
+    if (end==val || end!=colon)
+      return false;
+    }
+  else
+    raw=measure();
+  if (raw<=0 || raw>CAL_MAX)
+    return false;
+
+  int nearest=-1;
+  for (int i=0; i<settings.calCount; i++)
+    if (nearest<0 || abs(settings.calRaw[i]-(int)raw)<abs(settings.calRaw[nearest]-(int)raw))
+      nearest=i;
+  if (nearest>=0 && (abs(settings.calRaw[nearest]-(int)raw)<=CAL_MERGE || settings.calCount==CAL_POINTS))
+    {
+    settings.calCount--;
+    for (int i=nearest; i<settings.calCount; i++)
       {
-      // add it to the inputString 
-      commandString += inChar;
+      settings.calRaw[i]=settings.calRaw[i+1];
+      settings.calMillivolts[i]=settings.calMillivolts[i+1];
       }
     }
+
+  int i=settings.calCount; //keep it in order
+  while (i>0 && settings.calRaw[i-1]>raw)
+    {
+    settings.calRaw[i]=settings.calRaw[i-1];
+    settings.calMillivolts[i]=settings.calMillivolts[i-1];
+    i--;
+    }
+  settings.calRaw[i]=raw;
+  settings.calMillivolts[i]=mv;
+  settings.calCount++;
+  Serial.printf("Raw reading %ld is %ld mV.\n",raw,mv);
+  return true;
+  }
+
+/*
+ * The calibration table as raw:millivolts pairs. buf must hold CAL_TEXT_SIZE characters.
+ */
+void calibrationToString(char* buf)
+  {
+  int len=0;
+  buf[0]='\0';
+  for (int i=0; i<settings.calCount; i++)
+    len+=sprintf(buf+len,i==0?"%u:%u":",%u:%u",settings.calRaw[i],settings.calMillivolts[i]);
+  }
+
+
+/************************
+ * Do the MQTT thing
+ ************************/
+boolean report()
+  {  
+  boolean success=false;
+  int analog=lastReading;
+  //The packed formats are about saving airtime, so they send the rest only every so often
+  boolean diagnose=settings.reportFormat==REPORT_FORMAT_LEGACY
+    || (settings.diagnostics>0 && rtc.reportSeq%settings.diagnostics==0);
+
+  TRACE_INFO(EVENT_REPORT,rtc.reportSeq,"Publishing report %u from address %s\n",rtc.reportSeq,WiFi.localIP().toString().c_str());
+
+  if (settings.reportFormat==REPORT_FORMAT_LEGACY)
+    success=reportLegacy(analog);
+  else
+    success=reportPacked(analog);
+  if (success)
+    {
+    if (toPublishMs==0)
+      toPublishMs=millis(); //SDK init before millis() starts isn't counted
+    rtc.lastReported=analog; //for the deadband
+    rtc.lastReportMinute=(rtc.elapsedMs+millis())/60000;
+    }
+  rtc.reportSeq++;
+
+  //publish the readings that were taken with the radio off, if any. They stay in the
+  //batch until the delivery is confirmed.
+  addToBatch(analog);
+  batchSent=0;
+  if (rtc.batchCount>1)
+    {
+    if (publishBatch())
+      batchSent=rtc.batchCount;
+    else
+      {
+      TRACE_ERROR(EVENT_PUBLISH_FAILED,mqttClient.state(),"************ Failed publishing batch of readings!\n");
+      success=false;
+      }
+    }
+  else if (success)
+    {
+    batchSent=1; //the report carried it
+    }
+
+  if (diagnose)
+    reportDiagnostics(analog);
+
+  if (stayAwake)
+    Serial.println("Staying awake until next reset.");
+  return success;
+  }
+
+/*
+ * Publish the reading, voltage and signal strength as text on their own topics,
+ * the way it has always been done. Returns true if the reading was published.
+ */
+boolean reportLegacy(int analog)
+  {
+  char topic[MQTT_TOPIC_SIZE];
+  char reading[18];
+  boolean ok=false;
+  boolean success=false;
+
+  //publish the raw battery reading
+  strcpy(topic,settings.mqttTopic);
+  strcat(topic,MQTT_TOPIC_ANALOG);
+  sprintf(reading,"%d",analog); 
+  ok=publish(topic,reading,true); //retain
+  if (!ok)
+    TRACE_ERROR(EVENT_PUBLISH_FAILED,mqttClient.state(),"************ Failed publishing raw battery reading!\n");
+
+  //publish the battery voltage
+  strcpy(topic,settings.mqttTopic);
+  strcat(topic,MQTT_TOPIC_BATTERY);
+  formatVolts(toMillivolts(analog),reading);
+  success=publish(topic,reading,true); //retain
+  if (!success)
+    TRACE_ERROR(EVENT_PUBLISH_FAILED,mqttClient.state(),"************ Failed publishing battery voltage!\n");
+
+  //publish the signal strength
+  strcpy(topic,settings.mqttTopic);
+  strcat(topic,MQTT_TOPIC_RSSI);
+  sprintf(reading,"%d",(int)WiFi.RSSI());
+  success=publish(topic,reading,true); //retain
+  if (!success)
+    TRACE_ERROR(EVENT_PUBLISH_FAILED,mqttClient.state(),"************ Failed publishing signal strength!\n");
+  return ok;
+  }
+
+/*
+ * Publish everything about this reading in one message, as CSV or as a reportPacket.
+ */
+boolean reportPacked(int analog)
+  {
+  char topic[MQTT_TOPIC_SIZE];
+  int32_t rate=0;
+  int32_t hours=-1; //unknown
+  estimateLife(&rate,&hours);
+
+  reportPacket packet;
+  packet.version=REPORT_PACKET_VERSION;
+  packet.resetReason=ESP.getResetInfoPtr()->reason;
+  packet.raw=analog;
+  packet.millivolts=toMillivolts(analog);
+  packet.rssi=WiFi.RSSI();
+  packet.seq=rtc.reportSeq;
+  packet.hoursLeft=hours;
+  packet.ratePerDay=rate;
+  packet.variance=lastVariance;
+
+  strcpy(topic,settings.mqttTopic);
+  strcat(topic,MQTT_TOPIC_REPORT);
+  boolean success;
+  if (settings.reportFormat==REPORT_FORMAT_BINARY)
+    {
+    success=publish(topic,(uint8_t*)&packet,sizeof(packet),true); //retain
+    }
+  else
+    {
+    char csv[90];
+    sprintf(csv,"%u,%u,%u,%d,%u,%d,%s%d.%02d,%u",(unsigned int)packet.seq,packet.raw,packet.millivolts,
+      packet.rssi,packet.resetReason,(int)packet.hoursLeft,rate<0?"-":"",(int)abs(rate)/100,(int)abs(rate)%100,
+      (unsigned int)packet.variance);
+    success=publish(topic,csv,true); //retain
+    }
+  if (!success)
+    TRACE_ERROR(EVENT_PUBLISH_FAILED,mqttClient.state(),"************ Failed publishing report!\n");
+  return success;
+  }
+
+/*
+ * Publish the statistics that help tune the device: where the time went, the life
+ * estimate, the reading's variance, and how the delivery confirmation and WiFi cache
+ * are doing.
+ */
+void reportDiagnostics(int analog)
+  {
+  char topic[MQTT_TOPIC_SIZE];
+  char reading[18];
+  boolean success=false;
+
+  //publish where the time went last time, with the reading
+  success=publishTelemetry(analog);
+  if (!success)
+    TRACE_ERROR(EVENT_PUBLISH_FAILED,mqttClient.state(),"************ Failed publishing telemetry!\n");
+
+  //publish the remaining battery life estimate
+  strcpy(topic,settings.mqttTopic);
+  strcat(topic,MQTT_TOPIC_LIFE);
+  char life[50];
+  int32_t rate=0;
+  int32_t hours=-1; //unknown
+  estimateLife(&rate,&hours);
+  sprintf(life,"{\"rate\":%s%d.%02d,\"hours\":%d}",rate<0?"-":"",(int)abs(rate)/100,(int)abs(rate)%100,(int)hours);
+  success=publish(topic,life,true); //retain
+  if (!success)
+    TRACE_ERROR(EVENT_PUBLISH_FAILED,mqttClient.state(),"************ Failed publishing battery life estimate!\n");
+
+  //publish the variance of the samples that made up the reading
+  strcpy(topic,settings.mqttTopic);
+  strcat(topic,MQTT_TOPIC_VARIANCE);
+  sprintf(reading,"%u",lastVariance);
+  success=publish(topic,reading,true); //retain
+  if (!success)
+    TRACE_ERROR(EVENT_PUBLISH_FAILED,mqttClient.state(),"************ Failed publishing reading variance!\n");
+
+  //publish how long it took to confirm delivery last time
+  strcpy(topic,settings.mqttTopic);
+  strcat(topic,MQTT_TOPIC_CONFIRM);
+  char confirmStats[40];
+  sprintf(confirmStats,"{\"latency\":%u,\"timeouts\":%u}",rtc.confirmLatency,rtc.confirmTimeouts);
+  success=publish(topic,confirmStats,true); //retain
+  if (!success)
+    TRACE_ERROR(EVENT_PUBLISH_FAILED,mqttClient.state(),"************ Failed publishing delivery confirmation statistics!\n");
+
+  //publish how often the cached WiFi connection worked
+  strcpy(topic,settings.mqttTopic);
+  strcat(topic,MQTT_TOPIC_WIFI_CACHE);
+  char cacheStats[40];
+  sprintf(cacheStats,"{\"hits\":%u,\"misses\":%u}",rtc.fastConnects,rtc.slowConnects);
+  success=publish(topic,cacheStats,true); //retain
+  if (!success)
+    TRACE_ERROR(EVENT_PUBLISH_FAILED,mqttClient.state(),"************ Failed publishing WiFi cache statistics!\n");
+  }
+
+/*
+ * Send the time spent in each phase of the last wake, along with the current reading,
+ * as one message.
+ */
+boolean publishTelemetry(int analog)
+  {
+  char topic[MQTT_TOPIC_SIZE];
+  char payload[TELEMETRY_JSON_SIZE];
+  unsigned int total=0;
+  int len=sprintf(payload,"{\"analog\":%d",analog);
+  for (int i=0; i<PHASE_COUNT; i++)
+    {
+    len+=sprintf(payload+len,",\"%s\":%u",phaseNames[i],rtc.lastWakeTimes[i]);
+    total+=rtc.lastWakeTimes[i];
+    }
+  sprintf(payload+len,",\"total\":%u,\"toPublish\":%u,\"overlap\":%u}",total,rtc.lastToPublish,rtc.lastOverlap);
+
+  strcpy(topic,settings.mqttTopic);
+  strcat(topic,MQTT_TOPIC_TELEMETRY);
+  return publish(topic,payload,false);
+  }
+
+/*
+ * The network is back after some failed reports. Say how many, how many wakes the
+ * radio was rested, and what the outage cost in radio-on time.
+ */
+boolean publishOutage()
+  {
+  char topic[MQTT_TOPIC_SIZE];
+  char payload[100];
+  TRACE_INFO(EVENT_RECOVERED,rtc.failStreak,"Back after %u failed reports and %u rested wakes.\n",
+    rtc.failStreak,rtc.skippedWakes);
+  sprintf(payload,"{\"failed\":%u,\"skipped\":%u,\"radioMs\":%u,\"radioToday\":%u}",
+    rtc.failStreak,rtc.skippedWakes,rtc.outageRadioMs,rtc.radioMsToday);
+
+  strcpy(topic,settings.mqttTopic);
+  strcat(topic,MQTT_TOPIC_OUTAGE);
+  return publish(topic,payload,false);
+  }
+
+/*
+ * Time the phases of the wake. The time since the last mark is charged to the
+ * given phase.
+ */
+void markPhase(wakePhase phase)
+  {
+  unsigned long now=millis();
+  wakeTimes[phase]+=now-phaseStart;
+  phaseStart=now;
+  }
+
+/*
+ * Add a reading to the batch in RTC memory. If the batch is full it is moved to the
+ * flash log, or if that can't be done the oldest reading is dropped.
+ */
+void addToBatch(int raw)
+  {
+  if (rtc.batchCount==MAX_BATCH_SIZE && !spillBatch())
+    {
+    rtc.batchHead=(rtc.batchHead+1)%MAX_BATCH_SIZE;
+    rtc.batchCount--;
+    }
+  int slot=(rtc.batchHead+rtc.batchCount)%MAX_BATCH_SIZE;
+  rtc.batch[slot]=raw;
+  rtc.batchTime[slot]=(rtc.elapsedMs+millis())/60000;
+  rtc.batchCount++;
+  }
+
+/*
+ * A reading couldn't be sent. Put it in the batch so it goes out with the next
+ * report, or ends up in the flash log if the outage is a long one.
+ */
+void keepReading(int raw)
+  {
+  if (settingsAreValid)
+    addToBatch(raw);
+  }
+
+/*
+ * Send all of the batched readings, oldest first, in one message.
+ */
+boolean publishBatch()
+  {
+  char topic[MQTT_TOPIC_SIZE];
+  char payload[BATCH_JSON_SIZE];
+  uint16_t now=(rtc.elapsedMs+millis())/60000;
+  int len=sprintf(payload,"{\"interval\":%d,\"analog\":[",settings.sleepTime);
+  for (int i=0; i<rtc.batchCount; i++)
+    {
+    len+=sprintf(payload+len,i==0?"%u":",%u",(unsigned int)rtc.batch[(rtc.batchHead+i)%MAX_BATCH_SIZE]);
+    }
+  len+=sprintf(payload+len,"],\"age\":["); //minutes ago each was taken
+  for (int i=0; i<rtc.batchCount; i++)
+    {
+    uint16_t age=now-rtc.batchTime[(rtc.batchHead+i)%MAX_BATCH_SIZE];
+    len+=sprintf(payload+len,i==0?"%u":",%u",(unsigned int)age);
+    }
+  strcpy(payload+len,"]}");
+
+  strcpy(topic,settings.mqttTopic);
+  strcat(topic,MQTT_TOPIC_BATCH);
+  boolean ok=publish(topic,payload,false);
+  if (ok)
+    rtc.batchHead=0;
+  return ok;
+  }
+
+/*
+ * Mount the file system that holds the flash log. It is only done on wakes that
+ * need the log, since it takes time.
+ */
+boolean mountLog()
+  {
+  if (!logMounted)
+    {
+    logMounted=LittleFS.begin();
+    if (!logMounted)
+      TRACE_ERROR(EVENT_FLASH_LOG,0,"************ Failed mounting the file system for the log!\n");
+    }
+  return logMounted;
+  }
+
+void segmentName(char* name, uint32_t segment)
+  {
+  sprintf(name,"%s/%08x",LOG_DIR,(unsigned int)segment);
+  }
+
+/*
+ * Move the batch from RTC memory to the end of the flash log. The whole batch goes
+ * in one append per segment, so a block is rewritten once for every MAX_BATCH_SIZE
+ * readings rather than once for every reading.
+ */
+boolean spillBatch()
+  {
+  if (rtc.batchCount==0 || !mountLog())
+    return false;
+
+  uint32_t now=(rtc.elapsedMs+millis())/60000;
+  int i=0;
+  while (i<rtc.batchCount)
+    {
+    logRecord recs[MAX_BATCH_SIZE];
+    int count=0;
+    uint32_t segment=rtc.logTail/LOG_SEGMENT_RECORDS;
+    do
+      {
+      int slot=(rtc.batchHead+i)%MAX_BATCH_SIZE;
+      recs[count].seq=rtc.logTail+count;
+      recs[count].minute=now-(uint16_t)((uint16_t)now-rtc.batchTime[slot]);
+      recs[count].raw=rtc.batch[slot];
+      recs[count].spare=0;
+      count++;
+      i++;
+      } while (i<rtc.batchCount && (rtc.logTail+count)%LOG_SEGMENT_RECORDS!=0);
+
+    char name[20];
+    segmentName(name,segment);
+    File f=LittleFS.open(name,"a");
+    size_t written=f?f.write((uint8_t*)recs,count*sizeof(logRecord)):0;
+    f.close();
+    if (written!=count*sizeof(logRecord))
+      {
+      TRACE_ERROR(EVENT_FLASH_LOG,count,"************ Failed writing flash log!\n");
+      return false;
+      }
+    rtc.logTail+=count;
+    }
+  TRACE_DEBUG(EVENT_FLASH_LOG,i,"Moved %d readings to the flash log.\n",(int)i);
+  rtc.batchHead=0;
+  rtc.batchCount=0;
+  trimLog();
+  return true;
+  }
+
+/*
+ * Keep the log to LOG_MAX_SEGMENTS by dropping the oldest segments.
+ */
+void trimLog()
+  {
+  while (rtc.logTail/LOG_SEGMENT_RECORDS-rtc.logHead/LOG_SEGMENT_RECORDS>=LOG_MAX_SEGMENTS)
+    {
+    char name[20];
+    uint32_t segment=rtc.logHead/LOG_SEGMENT_RECORDS;
+    segmentName(name,segment);
+    LittleFS.remove(name);
+    rtc.logHead=(segment+1)*LOG_SEGMENT_RECORDS;
+    TRACE_WARN(EVENT_FLASH_LOG,LOG_SEGMENT_RECORDS,"Flash log is full, dropped the oldest readings.\n");
+    }
+  }
+
+/*
+ * Send the backlog in the flash log, oldest first, LOG_CHUNK_RECORDS readings per
+ * message. Nothing is removed until the delivery confirmation comes back, so if it
+ * doesn't the same readings are sent again next time. The sequence number of the
+ * first reading is in each message so the receiver can drop duplicates.
+ */
+void drainLog()
+  {
+  if (rtc.logTail==rtc.logHead || !mountLog())
+    return;
+
+  char topic[MQTT_TOPIC_SIZE];
+  strcpy(topic,settings.mqttTopic);
+  strcat(topic,MQTT_TOPIC_BACKLOG);
+  uint32_t now=(rtc.elapsedMs+millis())/60000;
+  uint32_t seq=rtc.logHead;
+  uint32_t openSegment=0xffffffff;
+  File f;
+  for (int chunk=0; chunk<LOG_CHUNKS_PER_WAKE && seq<rtc.logTail; chunk++)
+    {
+    logRecord recs[LOG_CHUNK_RECORDS];
+    int count=0;
+    uint32_t first=seq;
+    while (count<LOG_CHUNK_RECORDS && seq<rtc.logTail)
+      {
+      uint32_t segment=seq/LOG_SEGMENT_RECORDS;
+      if (segment!=openSegment)
+        {
+        char name[20];
+        segmentName(name,segment);
+        if (f)
+          f.close();
+        f=LittleFS.open(name,"r");
+        openSegment=segment;
+        if (!f) //lost, skip to the next one
+          {
+          seq=min((segment+1)*LOG_SEGMENT_RECORDS,rtc.logTail);
+          continue;
+          }
+        }
+      if (f.seek((seq%LOG_SEGMENT_RECORDS)*sizeof(logRecord))
+          && f.read((uint8_t*)&recs[count],sizeof(logRecord))==sizeof(logRecord)
+          && recs[count].seq==seq)
+        count++;
+      seq++;
+      }
+    if (count==0)
+      {
+      logSentUpTo=seq; //nothing readable in there
+      continue;
+      }
+
+    char payload[LOG_CHUNK_JSON_SIZE];
+    int len=sprintf(payload,"{\"seq\":%u,\"left\":%u,\"analog\":[",(unsigned int)first,(unsigned int)(rtc.logTail-seq));
+    for (int i=0; i<count; i++)
+      len+=sprintf(payload+len,i==0?"%u":",%u",(unsigned int)recs[i].raw);
+    len+=sprintf(payload+len,"],\"age\":["); //minutes ago each was taken, -1 if not known
+    for (int i=0; i<count; i++)
+      {
+      int age=recs[i].minute<=now?(int)(now-recs[i].minute):-1;
+      len+=sprintf(payload+len,i==0?"%d":",%d",age);
+      }
+    strcpy(payload+len,"]}");
+    if (!publish(topic,payload,false))
+      {
+      TRACE_ERROR(EVENT_PUBLISH_FAILED,mqttClient.state(),"************ Failed publishing backlog!\n");
+      break;
+      }
+    logSentUpTo=seq;
+    }
+  if (f)
+    f.close();
+  }
+
+/*
+ * The backlog sent this wake has been delivered, so remove the segments that
+ * are finished with.
+ */
+void commitLog()
+  {
+  if (logSentUpTo<=rtc.logHead)
+    return;
+  for (uint32_t segment=rtc.logHead/LOG_SEGMENT_RECORDS; segment<logSentUpTo/LOG_SEGMENT_RECORDS; segment++)
+    {
+    char name[20];
+    segmentName(name,segment);
+    LittleFS.remove(name);
+    }
+  rtc.logHead=logSentUpTo;
+  }
+
+/*
+ * The readings published from the batch this wake have been delivered, so drop them.
+ */
+void commitBatch()
+  {
+  batchSent=min(batchSent,rtc.batchCount);
+  rtc.batchHead=(rtc.batchHead+batchSent)%MAX_BATCH_SIZE;
+  rtc.batchCount-=batchSent;
+  batchSent=0;
+  }
+
+/*
+ * RTC memory was lost, so find the ends of the flash log from the segment files.
+ * Readings that were sent but not yet removed will be sent again.
+ */
+void recoverLog()
+  {
+  if (!mountLog())
+    return;
+  uint32_t lowest=0xffffffff;
+  uint32_t highest=0;
+  size_t highestSize=0;
+  Dir dir=LittleFS.openDir(LOG_DIR);
+  while (dir.next())
+    {
+    uint32_t segment=strtoul(dir.fileName().c_str(),NULL,16);
+    lowest=min(lowest,segment);
+    if (segment>=highest)
+      {
+      highest=segment;
+      highestSize=dir.fileSize();
+      }
+    }
+  if (lowest!=0xffffffff)
+    {
+    rtc.logHead=lowest*LOG_SEGMENT_RECORDS;
+    rtc.logTail=highest*LOG_SEGMENT_RECORDS+highestSize/sizeof(logRecord);
+    TRACE_INFO(EVENT_FLASH_LOG,rtc.logTail-rtc.logHead,"Found %u readings in the flash log.\n",(unsigned int)(rtc.logTail-rtc.logHead));
+    }
+  }
+
+boolean publish(char* topic, const char* reading, boolean retain)
+  {
+  TRACE_DEBUG(EVENT_PUBLISH,strlen(reading),"%s %s\n",topic,reading);
+  return publishPayload(topic,(const uint8_t*)reading,strlen(reading),retain);
+  }
+
+boolean publish(char* topic, const uint8_t* payload, unsigned int length, boolean retain)
+  {
+  TRACE_DEBUG(EVENT_PUBLISH,length,"%s <%u bytes>\n",topic,length);
+  return publishPayload(topic,payload,length,retain);
+  }
+
+/*
+ * A message that fits in the MQTT client's buffer goes out in one write. A bigger
+ * one is streamed, so the buffer never has to be enlarged for it.
+ */
+boolean publishPayload(const char* topic, const uint8_t* payload, unsigned int length, boolean retain)
+  {
+  if (MQTT_OVERHEAD+strlen(topic)+length<=mqttClient.getBufferSize())
+    return mqttClient.publish(topic,payload,length,retain);
+  return mqttClient.beginPublish(topic,length,retain)
+    && mqttClient.write(payload,length)==length
+    && mqttClient.endPublish();
+  }
+
+/*
+ * Publish JSON produced by writer without building it in memory. The writer is run
+ * twice: once to count the bytes, since beginPublish() needs the length up front,
+ * then again to send them.
+ */
+boolean publishJson(char* topic, void (*writer)(jsonWriter*), boolean retain)
+  {
+  jsonWriter json;
+  json.client=NULL;
+  json.length=0;
+  json.chunkLength=0;
+  json.first=true;
+  writer(&json);
+  size_t length=json.length;
+
+  TRACE_DEBUG(EVENT_PUBLISH,length,"%s <%u bytes of JSON>\n",topic,(unsigned int)length);
+  if (!mqttClient.beginPublish(topic,length,retain))
+    return false;
+  json.client=&mqttClient;
+  json.length=0;
+  json.first=true;
+  writer(&json);
+  jsonFlush(&json);
+  return mqttClient.endPublish() && json.length==length;
+  }
+
+/*
+ * Add text to the JSON as is.
+ */
+void jsonRaw(jsonWriter* json, const char* text, size_t length)
+  {
+  json->length+=length;
+  if (json->client==NULL)
+    return;
+  while (length>0)
+    {
+    size_t n=min(length,sizeof(json->chunk)-json->chunkLength);
+    memcpy(json->chunk+json->chunkLength,text,n);
+    json->chunkLength+=n;
+    text+=n;
+    length-=n;
+    if (json->chunkLength==sizeof(json->chunk))
+      jsonFlush(json);
+    }
+  }
+
+void jsonFlush(jsonWriter* json)
+  {
+  if (json->client!=NULL && json->chunkLength>0)
+    json->client->write(json->chunk,json->chunkLength);
+  json->chunkLength=0;
+  }
+
+/*
+ * Add a quoted string, escaping what JSON requires.
+ */
+void jsonEscaped(jsonWriter* json, const char* text)
+  {
+  jsonRaw(json,"\"",1);
+  for (const char* c=text; *c!='\0'; c++)
+    {
+    char escaped[7];
+    if (*c=='"' || *c=='\\')
+      {
+      escaped[0]='\\';
+      escaped[1]=*c;
+      jsonRaw(json,escaped,2);
+      }
+    else if ((uint8_t)*c<0x20)
+      jsonRaw(json,escaped,sprintf(escaped,"\\u%04x",(unsigned int)(uint8_t)*c));
+    else
+      jsonRaw(json,c,1);
+    }
+  jsonRaw(json,"\"",1);
+  }
+
+/*
+ * Start a member of the current object: the comma if needed, the name and the colon.
+ */
+void jsonKey(jsonWriter* json, const char* name)
+  {
+  if (!json->first)
+    jsonRaw(json,", ",2);
+  json->first=false;
+  jsonEscaped(json,name);
+  jsonRaw(json,":",1);
+  }
+
+void jsonBeginObject(jsonWriter* json)
+  {
+  jsonRaw(json,"{",1);
+  json->first=true;
+  }
+
+void jsonEndObject(jsonWriter* json)
+  {
+  jsonRaw(json,"}",1);
+  json->first=false;
+  }
+
+void jsonString(jsonWriter* json, const char* name, const char* value)
+  {
+  jsonKey(json,name);
+  jsonEscaped(json,value);
+  }
+
+void jsonNumber(jsonWriter* json, const char* name, long value)
+  {
+  char number[12];
+  jsonKey(json,name);
+  jsonRaw(json,number,sprintf(number,"%ld",value));
+  }
+
+/*
+ * All of the settings, and the address we have.
+ */
+void writeSettingsJson(jsonWriter* json)
+  {
+  char value[SETTING_VALUE_SIZE];
+  jsonBeginObject(json);
+  for (size_t i=0; i<SETTING_COUNT; i++)
+    {
+    const settingDescriptor* setting=&settingTable[i];
+    const uint8_t* field=(const uint8_t*)&settings+setting->offset;
+    if (setting->type==SETTING_INT)
+      jsonNumber(json,setting->name,*(const int*)field);
+    else if (setting->type==SETTING_BOOL)
+      jsonNumber(json,setting->name,*(const bool*)field?1:0);
+    else
+      {
+      settingToString(setting,value,sizeof(value));
+      jsonString(json,setting->name,value);
+      }
+    }
+  char table[CAL_TEXT_SIZE];
+  calibrationToString(table);
+  jsonString(json,"calibration",table);
+  IPAddress address=WiFi.localIP();
+  sprintf(value,"%u.%u.%u.%u",address[0],address[1],address[2],address[3]);
+  jsonString(json,"IP Address",value);
+  jsonEndObject(json);
+  }
+
+  
+/*
+*  Initialize the settings from eeprom and determine if they are valid
+*/
+void loadSettings()
+  {
+  EEPROM.get(0,settings);
+  if (settings.mqttBrokerPort>=0) //erased flash is caught in setup()
+    {
+    sanitizeSettings(); //settings added since the EEPROM was written aren't there yet
+    generateMqttClientId(settings.mqttClientId); //replaces a random one saved by older firmware
+    }
+  if (settings.validConfig==VALID_SETTINGS_FLAG)    //skip loading stuff if it's never been written
+    {
+    settingsAreValid=true;
+    TRACE_DEBUG(EVENT_SETTINGS,1,"Loaded configuration values from EEPROM\n");
+    }
+  else
+    {
+    TRACE_WARN(EVENT_SETTINGS,0,"Skipping load from EEPROM, device not configured.\n");
+    settingsAreValid=false;
+    }
+  }
+
+/*
+ * Save the settings to EEPROM. Set the valid flag if everything is filled in.
+ */
+boolean saveSettings()
+  {
+  //The mqttClientId is not set by the user, but we need to make sure it's set  
+  if (strlen(settings.mqttClientId)==0)
+    {
+    generateMqttClientId(settings.mqttClientId);
+    }
+
+  settingsAreValid=true;
+  for (size_t i=0; i<SETTING_COUNT; i++)
+    {
+    const settingDescriptor* setting=&settingTable[i];
+    const uint8_t* field=(const uint8_t*)&settings+setting->offset;
+    if ((setting->flags & SETTING_REQUIRED)
+        && (setting->type==SETTING_TEXT ? field[0]=='\0' : *(const int*)field==0))
+      settingsAreValid=false;
+    }
+  if (settingsAreValid)
+    {
+    Serial.println("Settings deemed complete");
+    settings.validConfig=VALID_SETTINGS_FLAG;
+    }
+  else
+    {
+    Serial.println("Settings still incomplete");
+    settings.validConfig=0;
+    }
+    
+  EEPROM.put(0,settings);
+  return EEPROM.commit();
+  }
+
+/*
+ * Read the values that were saved in RTC memory before the last deep sleep.
+ * If they fail the CRC check (power-on, for example), start fresh.
+ */
+boolean loadRTC()
+  {
+  ESP.rtcUserMemoryRead(RTC_DATA_OFFSET, (uint32_t*)&rtc, sizeof(rtc));
+  uint32_t crc=calculateCRC32(((uint8_t*)&rtc)+sizeof(rtc.crc), sizeof(rtc)-sizeof(rtc.crc));
+  rtcIsValid=crc==rtc.crc && rtc.validRTC==VALID_RTC_FLAG;
+  if (!rtcIsValid)
+    {
+    TRACE_INFO(EVENT_RTC_LOST,0,"RTC memory is not valid, initializing it.\n");
+    rtc=rtcConf(); //back to the defaults
+    rtc.validRTC=VALID_RTC_FLAG;
+    }
+  return rtcIsValid;
+  }
+
+/*
+ * Save the RTC values so they survive deep sleep.
+ */
+void saveRTC()
+  {
+  rtc.validRTC=VALID_RTC_FLAG;
+  rtc.crc=calculateCRC32(((uint8_t*)&rtc)+sizeof(rtc.crc), sizeof(rtc)-sizeof(rtc.crc));
+  ESP.rtcUserMemoryWrite(RTC_DATA_OFFSET, (uint32_t*)&rtc, sizeof(rtc));
+  }
+
+/*
+ * Pick up the trace ring where the last wake left it, or start a new one.
+ */
+void traceBegin()
+  {
+  ESP.rtcUserMemoryRead(TRACE_OFFSET,(uint32_t*)&trace,sizeof(trace));
+  if (trace.valid!=VALID_TRACE_FLAG || trace.head>=TRACE_SIZE || trace.count>TRACE_SIZE)
+    {
+    memset(&trace,0,sizeof(trace));
+    trace.valid=VALID_TRACE_FLAG;
+    }
+  trace.wake++;
+  ESP.rtcUserMemoryWrite(TRACE_OFFSET,(uint32_t*)&trace,sizeof(trace));
+  }
+
+/*
+ * Add an event to the trace ring, overwriting the oldest when it's full. Use the
+ * TRACE macros rather than calling this directly.
+ */
+void traceEvent(uint8_t event, int32_t value)
+  {
+  if (trace.valid!=VALID_TRACE_FLAG) //traceBegin() hasn't run
+    return;
+  traceEntry entry;
+  entry.event=event;
+  entry.wake=(uint8_t)trace.wake;
+  entry.ms=(uint16_t)min(millis(),65535UL);
+  entry.value=value;
+  ESP.rtcUserMemoryWrite(TRACE_OFFSET+(sizeof(trace)+trace.head*sizeof(entry))/4,(uint32_t*)&entry,sizeof(entry));
+  trace.head=(trace.head+1)%TRACE_SIZE;
+  if (trace.count<TRACE_SIZE)
+    trace.count++;
+  ESP.rtcUserMemoryWrite(TRACE_OFFSET,(uint32_t*)&trace,sizeof(trace));
+  }
+
+/*
+ * Print the trace ring on the console, oldest first.
+ */
+void showTrace()
+  {
+  Serial.printf("Last %u events, with how many wakes ago each happened:\n",trace.count);
+  for (int i=0; i<trace.count; i++)
+    {
+    traceEntry entry;
+    int slot=(trace.head+TRACE_SIZE-trace.count+i)%TRACE_SIZE;
+    ESP.rtcUserMemoryRead(TRACE_OFFSET+(sizeof(trace)+slot*sizeof(entry))/4,(uint32_t*)&entry,sizeof(entry));
+    Serial.printf("%4u %6ums %-15s %d\n",(uint8_t)(trace.wake-entry.wake),entry.ms,
+      entry.event<EVENT_COUNT?eventNames[entry.event]:"?",(int)entry.value);
+    }
+  }
+
+/*
+ * Publish the trace ring as traceEntry structs, oldest first. Little-endian, no
+ * padding, event numbers as in traceEventId.
+ */
+boolean publishTrace()
+  {
+  char topic[MQTT_TOPIC_SIZE];
+  traceEntry entries[TRACE_SIZE];
+  for (int i=0; i<trace.count; i++)
+    {
+    int slot=(trace.head+TRACE_SIZE-trace.count+i)%TRACE_SIZE;
+    ESP.rtcUserMemoryRead(TRACE_OFFSET+(sizeof(trace)+slot*sizeof(traceEntry))/4,(uint32_t*)&entries[i],sizeof(traceEntry));
+    }
+  strcpy(topic,settings.mqttTopic);
+  strcat(topic,MQTT_TOPIC_TRACE);
+  return publish(topic,(uint8_t*)entries,trace.count*sizeof(traceEntry),false);
+  }
+
+/*
+ * Remember the access point and addresses of the current connection so that
+ * the next wake can connect without scanning or waiting for DHCP.
+ */
+void cacheWiFi()
+  {
+  memcpy(rtc.bssid,WiFi.BSSID(),sizeof(rtc.bssid));
+  rtc.channel=WiFi.channel();
+  rtc.localIP=(uint32_t)WiFi.localIP();
+  rtc.gateway=(uint32_t)WiFi.gatewayIP();
+  rtc.netmask=(uint32_t)WiFi.subnetMask();
+  rtc.dns=(uint32_t)WiFi.dnsIP();
+  rtcIsValid=true;
+  }
+
+uint32_t calculateCRC32(const uint8_t *data, size_t length)
+  {
+  uint32_t crc=0xffffffff;
+  while (length--)
+    {
+    uint8_t c=*data++;
+    for (uint32_t i=0x80; i>0; i>>=1)
+      {
+      bool bit=crc & 0x80000000;
+      if (c & i)
+        bit=!bit;
+      crc <<= 1;
+      if (bit)
+        crc ^= 0x04c11db7;
+      }
+    }
+  return crc;
+  }
+
+
+//Generate an MQTT client ID.  This should not be necessary very often
+/*
+ * The client ID comes from the MAC address, so every unit has its own and keeps it.
+ * Two units with the same ID would keep knocking each other off the broker.
+ */
+char* generateMqttClientId(char* mqttId)
+  {
+  uint8_t mac[6];
+  WiFi.macAddress(mac);
+  snprintf(mqttId,MQTT_CLIENTID_SIZE,"%s%02x%02x%02x%02x%02x%02x",MQTT_CLIENT_ID_ROOT,
+    mac[0],mac[1],mac[2],mac[3],mac[4],mac[5]);
+  if (settings.debug)
+    {
+    Serial.print("MQTT client ID is ");
+    Serial.println(mqttId);
+    }
+  return mqttId;
+  }
+  
+/*
+ * Start the console for output as well as input. Until then, anything printed is
+ * thrown away.
+ */
+void startConsole()
+  {
+  if (consoleOn)
+    return;
+  Serial.begin(9600);
+  Serial.setTimeout(10000);
+  Serial.println();
+  
+  while (!Serial); // wait here for serial port to connect.
+  Serial.println("Serial line initialized.");
+  consoleOn=true;
+  }
+
+/*
+  SerialEvent occurs whenever a new data comes in the hardware serial RX. This
+  routine is run between each time loop() runs, so using delay inside loop can
+  delay response. Multiple bytes of data may be available.
+*/
+void serialEvent() 
+  {
+  //Stop at the end of a line. Anything after it waits in the UART buffer until this one is done.
+  while (!commandComplete && Serial.available()) 
+    {
+    // get the new byte
+    char inChar = (char)Serial.read();
+    if (consoleOn)
+      Serial.print(inChar); //echo it back to the terminal
+
+    // if the incoming character is a newline, set a flag so the main loop can
+    // do something about it 
+    if (inChar == '\n') 
+      {
+      commandComplete = true;
+      }
+    else if (commandLength<sizeof(commandLine)-1)
+      {
+      commandLine[commandLength++]=inChar; // add it to the line
+      }
+    else
+      {
+      commandOverflow=true; //keep reading to the end of the line, then drop it
+      }
+    }
+
+  //Someone is there, so start talking. Starting the UART again empties its buffer,
+  //which is why what was typed so far had to be read first.
+  if (!consoleOn && (commandLength>0 || commandComplete))
+    {
+    rtc.consoleWanted=true;
+    startConsole();
+    Serial.write(commandLine,commandLength);
+    }
   }